@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mtk_da.h"
+#include "mtk_preloader.h"
+
+#include "loopback.h"
+
+#define RUNS (5)
+#define ITERATIONS (64)
+
+static uint8_t buffer[0x100000];
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = i * 2654435761U >> 24;
+    }
+
+    /* Accumulate the results, so that the checksums are not optimised away */
+    volatile uint16_t sink = 0;
+
+    uint64_t best_da = UINT64_MAX, best_preloader = UINT64_MAX;
+
+    for (int run = 0; run < RUNS; run++) {
+        uint64_t start = bench_now();
+        for (int i = 0; i < ITERATIONS; i++) {
+            sink += mtk_da_checksum(buffer, sizeof(buffer));
+        }
+        uint64_t elapsed = bench_now() - start;
+        if (elapsed < best_da) {
+            best_da = elapsed;
+        }
+
+        start = bench_now();
+        for (int i = 0; i < ITERATIONS; i++) {
+            sink += mtk_preloader_checksum(buffer, sizeof(buffer));
+        }
+        elapsed = bench_now() - start;
+        if (elapsed < best_preloader) {
+            best_preloader = elapsed;
+        }
+    }
+
+    bench_report("mtk_da_checksum", ITERATIONS * sizeof(buffer), best_da);
+    bench_report("mtk_preloader_checksum", ITERATIONS * sizeof(buffer), best_preloader);
+
+    return 0;
+}
@@ -0,0 +1,61 @@
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mtk_da.h"
+#include "mtk_device.h"
+
+#include "loopback.h"
+
+#define RUNS (5)
+#define TRANSFER_SIZE (256 * 0x100000)
+
+static int null_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) offset;
+    (void) total_length;
+    (void) user_data;
+
+    if (flashing) {
+        memset(buffer, 0, count);
+    }
+
+    return 0;
+}
+
+int main(void) {
+    static struct loopback lb;
+    loopback_init(&lb, false);
+
+    mtk_device device;
+    mtk_device_open_transport(&device, &loopback_transport, &lb);
+
+    uint64_t best_read = UINT64_MAX, best_write = UINT64_MAX;
+
+    for (int run = 0; run < RUNS; run++) {
+        uint8_t retval;
+
+        uint64_t start = bench_now();
+        if (mtk_da_read(&device, MTK_DA_HW_STORAGE_EMMC, 0, TRANSFER_SIZE, &retval, null_handler, NULL) < 0 || retval != MTK_DA_ACK) {
+            errx(1, "mtk_da_read failed");
+        }
+        uint64_t elapsed = bench_now() - start;
+        if (elapsed < best_read) {
+            best_read = elapsed;
+        }
+
+        start = bench_now();
+        if (mtk_da_sdmmc_write_data(&device, MTK_DA_STORAGE_EMMC, MTK_DA_EMMC_PART_USER, 0, TRANSFER_SIZE, MTK_DA_EMMC_ERASE_GROUP, &retval, null_handler, NULL) < 0 || retval != MTK_DA_CONT_CHAR) {
+            errx(1, "mtk_da_sdmmc_write_data failed");
+        }
+        elapsed = bench_now() - start;
+        if (elapsed < best_write) {
+            best_write = elapsed;
+        }
+    }
+
+    bench_report("mtk_da_read", TRANSFER_SIZE, best_read);
+    bench_report("mtk_da_sdmmc_write_data", TRANSFER_SIZE, best_write);
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mtk_device.h"
+
+#include "loopback.h"
+
+#define RUNS (5)
+#define TRANSFER_SIZE (64 * 0x100000)
+#define SMALL_COUNT (0x100000)
+
+static uint8_t buffer[0x100000];
+
+int main(void) {
+    static struct loopback lb;
+    loopback_init(&lb, true);
+
+    mtk_device device;
+    mtk_device_open_transport(&device, &loopback_transport, &lb);
+
+    uint64_t best_read = UINT64_MAX, best_write = UINT64_MAX, best_read32 = UINT64_MAX;
+
+    for (int run = 0; run < RUNS; run++) {
+        uint64_t start = bench_now();
+        for (size_t offset = 0; offset < TRANSFER_SIZE; offset += sizeof(buffer)) {
+            if (mtk_device_read(&device, buffer, sizeof(buffer)) < 0) {
+                errx(1, "mtk_device_read failed");
+            }
+        }
+        uint64_t elapsed = bench_now() - start;
+        if (elapsed < best_read) {
+            best_read = elapsed;
+        }
+
+        start = bench_now();
+        for (size_t offset = 0; offset < TRANSFER_SIZE; offset += MTK_DEVICE_PKTSIZE) {
+            if (mtk_device_write(&device, buffer, MTK_DEVICE_PKTSIZE) < 0) {
+                errx(1, "mtk_device_write failed");
+            }
+        }
+        elapsed = bench_now() - start;
+        if (elapsed < best_write) {
+            best_write = elapsed;
+        }
+
+        start = bench_now();
+        for (size_t i = 0; i < SMALL_COUNT; i++) {
+            uint32_t data32;
+            if (mtk_device_read32(&device, &data32) < 0) {
+                errx(1, "mtk_device_read32 failed");
+            }
+        }
+        elapsed = bench_now() - start;
+        if (elapsed < best_read32) {
+            best_read32 = elapsed;
+        }
+    }
+
+    bench_report("mtk_device_read (1 MiB)", TRANSFER_SIZE, best_read);
+    bench_report("mtk_device_write (512 B)", TRANSFER_SIZE, best_write);
+    bench_report("mtk_device_read32", SMALL_COUNT * sizeof(uint32_t), best_read32);
+
+    return 0;
+}
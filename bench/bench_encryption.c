@@ -0,0 +1,95 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "encryption.h"
+#include "io_handler.h"
+
+#include "loopback.h"
+
+#define RUNS (3)
+#define FILE_SIZE (256 * 0x100000)
+
+static uint8_t pattern[0x100000];
+static uint8_t buffer[0x100000];
+static uint8_t expected[0x100000];
+
+/* Stamps the offset into each chunk, so chunks decrypted in the wrong place do not match */
+static void fill_chunk(uint8_t *chunk, size_t offset) {
+    memcpy(chunk, pattern, sizeof(pattern));
+    memcpy(chunk, &offset, sizeof(offset));
+}
+
+int main(void) {
+    char path[] = "bench_encryption.XXXXXX";
+
+    int fd;
+    if ((fd = mkstemp(path)) < 0) {
+        err(1, "Unable to create temporary file");
+    }
+    unlink(path);
+
+    uint8_t key[ENCRYPTION_KEY_SIZE];
+    memset(key, 0x5a, sizeof(key));
+
+    for (size_t i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = i * 2654435761U >> 24;
+    }
+
+    uint64_t best_encrypt = UINT64_MAX, best_decrypt = UINT64_MAX;
+
+    for (int run = 0; run < RUNS; run++) {
+        struct file_info fi;
+        struct encryption *encryption;
+
+        io_handler_init(&fi, fd);
+        uint64_t start = bench_now();
+        if (encryption_init(&encryption, &fi, key, false, FILE_SIZE) < 0) {
+            errx(1, "encryption_init failed");
+        }
+        for (size_t offset = 0; offset < FILE_SIZE; offset += sizeof(buffer)) {
+            fill_chunk(buffer, offset);
+            if (encryption_handler(false, offset, FILE_SIZE, buffer, sizeof(buffer), encryption) < 0) {
+                errx(1, "encryption_handler failed");
+            }
+        }
+        if (encryption_finish(encryption) < 0 || io_handler_finish(&fi) < 0) {
+            errx(1, "encryption_finish failed");
+        }
+        uint64_t elapsed = bench_now() - start;
+        if (elapsed < best_encrypt) {
+            best_encrypt = elapsed;
+        }
+
+        io_handler_init(&fi, fd);
+        start = bench_now();
+        if (encryption_init(&encryption, &fi, key, true, FILE_SIZE) < 0) {
+            errx(1, "encryption_init failed");
+        }
+        for (size_t offset = 0; offset < FILE_SIZE; offset += sizeof(buffer)) {
+            if (encryption_handler(true, offset, FILE_SIZE, buffer, sizeof(buffer), encryption) < 0) {
+                errx(1, "encryption_handler failed");
+            }
+            fill_chunk(expected, offset);
+            if (memcmp(buffer, expected, sizeof(buffer)) != 0) {
+                errx(1, "Decrypted data does not match");
+            }
+        }
+        if (encryption_finish(encryption) < 0 || io_handler_finish(&fi) < 0) {
+            errx(1, "encryption_finish failed");
+        }
+        elapsed = bench_now() - start;
+        if (elapsed < best_decrypt) {
+            best_decrypt = elapsed;
+        }
+    }
+
+    close(fd);
+
+    bench_report("encryption encrypt", FILE_SIZE, best_encrypt);
+    bench_report("encryption decrypt", FILE_SIZE, best_decrypt);
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "io_handler.h"
+
+#include "loopback.h"
+
+#define RUNS (3)
+#define FILE_SIZE (256 * 0x100000)
+
+static uint8_t buffer[0x100000];
+
+int main(void) {
+    char path[] = "bench_io_handler.XXXXXX";
+
+    int fd;
+    if ((fd = mkstemp(path)) < 0) {
+        err(1, "Unable to create temporary file");
+    }
+    unlink(path);
+
+    uint64_t best_write = UINT64_MAX, best_read = UINT64_MAX;
+
+    for (int run = 0; run < RUNS; run++) {
+        struct file_info fi;
+
+        io_handler_init(&fi, fd);
+        uint64_t start = bench_now();
+        for (size_t offset = 0; offset < FILE_SIZE; offset += sizeof(buffer)) {
+            io_handler(false, offset, FILE_SIZE, buffer, sizeof(buffer), &fi);
+        }
+        io_handler_finish(&fi);
+        uint64_t elapsed = bench_now() - start;
+        if (elapsed < best_write) {
+            best_write = elapsed;
+        }
+
+        io_handler_init(&fi, fd);
+        start = bench_now();
+        for (size_t offset = 0; offset < FILE_SIZE; offset += sizeof(buffer)) {
+            io_handler(true, offset, FILE_SIZE, buffer, sizeof(buffer), &fi);
+        }
+        io_handler_finish(&fi);
+        elapsed = bench_now() - start;
+        if (elapsed < best_read) {
+            best_read = elapsed;
+        }
+    }
+
+    close(fd);
+
+    bench_report("io_handler write", FILE_SIZE, best_write);
+    bench_report("io_handler read", FILE_SIZE, best_read);
+
+    return 0;
+}
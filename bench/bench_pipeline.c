@@ -0,0 +1,87 @@
+#include <err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mtk_capture.h"
+#include "mtk_da.h"
+#include "mtk_device.h"
+#include "mtk_pipeline.h"
+
+#include "loopback.h"
+
+#define RUNS (3)
+#define TRANSFER_SIZE (256 * 0x100000)
+#define STAGES (3)
+
+/* Stands in for a stage with real work to do, such as hashing or compressing */
+static int fnv_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) flashing;
+    (void) offset;
+    (void) total_length;
+
+    uint64_t *hash = user_data;
+    *hash = mtk_fnv1a64(*hash, buffer, count);
+
+    return 0;
+}
+
+static uint64_t run(mtk_device *device, bool threaded) {
+    uint64_t hashes[STAGES];
+
+    mtk_pipeline pipeline;
+    if (mtk_pipeline_init(&pipeline, MTK_PIPELINE_DEFAULT_DEPTH) < 0) {
+        errx(1, "mtk_pipeline_init failed");
+    }
+    for (int i = 0; i < STAGES; i++) {
+        hashes[i] = MTK_FNV1A64_INIT;
+        if (mtk_pipeline_add_stage(&pipeline, fnv_handler, &hashes[i], threaded) < 0) {
+            errx(1, "mtk_pipeline_add_stage failed");
+        }
+    }
+
+    uint8_t retval;
+
+    uint64_t start = bench_now();
+    if (mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, 0, TRANSFER_SIZE, &retval, mtk_pipeline_handler, &pipeline) < 0 || retval != MTK_DA_ACK) {
+        errx(1, "mtk_da_read failed");
+    }
+    if (mtk_pipeline_finish(&pipeline) < 0) {
+        errx(1, "mtk_pipeline_finish failed");
+    }
+    uint64_t elapsed = bench_now() - start;
+
+    for (int i = 1; i < STAGES; i++) {
+        if (hashes[i] != hashes[0]) {
+            errx(1, "Stages saw different data");
+        }
+    }
+
+    return elapsed;
+}
+
+int main(void) {
+    static struct loopback lb;
+    loopback_init(&lb, false);
+
+    mtk_device device;
+    mtk_device_open_transport(&device, &loopback_transport, &lb);
+
+    uint64_t best_inline = UINT64_MAX, best_threaded = UINT64_MAX;
+
+    for (int i = 0; i < RUNS; i++) {
+        uint64_t elapsed = run(&device, false);
+        if (elapsed < best_inline) {
+            best_inline = elapsed;
+        }
+
+        elapsed = run(&device, true);
+        if (elapsed < best_threaded) {
+            best_threaded = elapsed;
+        }
+    }
+
+    bench_report("pipeline inline", TRANSFER_SIZE, best_inline);
+    bench_report("pipeline threaded", TRANSFER_SIZE, best_threaded);
+
+    return 0;
+}
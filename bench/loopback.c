@@ -0,0 +1,234 @@
+#include "loopback.h"
+
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "mtk_da.h"
+
+enum {
+    STATE_IDLE,
+    STATE_READ_HEADER,
+    STATE_READ_PKTLEN,
+    STATE_READ_ACK,
+    STATE_WRITE_HEADER,
+    STATE_WRITE_ACK,
+    STATE_WRITE_DATA,
+    STATE_WRITE_CHKSUM,
+};
+
+/* Host OS, storage, address and length, or storage, partition, address, length and packet length */
+#define READ_HEADER_SIZE (1 + 1 + 8 + 8)
+#define WRITE_HEADER_SIZE (1 + 1 + 8 + 8 + 4)
+
+static int loopback_bulk_transfer(void *ctx, uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout);
+static int loopback_control_transfer(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout);
+
+const mtk_transport loopback_transport = {
+    .bulk_transfer = loopback_bulk_transfer,
+    .control_transfer = loopback_control_transfer,
+};
+
+void loopback_init(struct loopback *lb, bool raw) {
+    lb->raw = raw;
+
+    for (size_t i = 0; i < sizeof(lb->pattern); i++) {
+        lb->pattern[i] = i * 2654435761U >> 24;
+    }
+    lb->pattern_chksum = mtk_da_checksum(lb->pattern, sizeof(lb->pattern));
+
+    lb->state = STATE_IDLE;
+    lb->header_len = 0;
+    lb->header_need = 1;
+    lb->skip = 0;
+    lb->segments_count = 0;
+}
+
+uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_report(const char *name, uint64_t bytes, uint64_t ns) {
+    printf("%-40s %10.2f MB/s\n", name, bytes * 1e3 / ns);
+    fflush(stdout);
+}
+
+static void push(struct loopback *lb, const uint8_t *data, size_t len) {
+    lb->segments[lb->segments_count].data = data;
+    lb->segments[lb->segments_count].len = len;
+    lb->segments_count++;
+}
+
+static void push_reply8(struct loopback *lb, uint8_t value) {
+    lb->reply[0] = value;
+    push(lb, lb->reply, 1);
+}
+
+static void push_chunk(struct loopback *lb) {
+    lb->chunk = lb->remaining < lb->packet_length ? lb->remaining : lb->packet_length;
+
+    uint16_t chksum = (lb->chunk == sizeof(lb->pattern)) ? lb->pattern_chksum : mtk_da_checksum(lb->pattern, lb->chunk);
+    chksum = htobe16(chksum);
+    memcpy(lb->reply, &chksum, sizeof(chksum));
+
+    push(lb, lb->pattern, lb->chunk);
+    push(lb, lb->reply, sizeof(chksum));
+}
+
+static uint64_t header_be64(const struct loopback *lb, size_t offset) {
+    uint64_t value;
+    memcpy(&value, lb->header + offset, sizeof(value));
+    return be64toh(value);
+}
+
+static uint32_t header_be32(const struct loopback *lb, size_t offset) {
+    uint32_t value;
+    memcpy(&value, lb->header + offset, sizeof(value));
+    return be32toh(value);
+}
+
+static void expect(struct loopback *lb, int state, size_t need) {
+    lb->state = state;
+    lb->header_len = 0;
+    lb->header_need = need;
+}
+
+static void step(struct loopback *lb) {
+    switch (lb->state) {
+        case STATE_IDLE:
+            if (lb->header[0] == MTK_DA_READ_CMD) {
+                expect(lb, STATE_READ_HEADER, READ_HEADER_SIZE);
+            } else if (lb->header[0] == MTK_DA_SDMMC_WRITE_DATA_CMD) {
+                expect(lb, STATE_WRITE_HEADER, WRITE_HEADER_SIZE);
+            } else {
+                expect(lb, STATE_IDLE, 1);
+            }
+            break;
+
+        case STATE_READ_HEADER:
+            lb->remaining = header_be64(lb, 10);
+            push_reply8(lb, MTK_DA_ACK);
+            expect(lb, STATE_READ_PKTLEN, 4);
+            break;
+
+        case STATE_READ_PKTLEN:
+            lb->packet_length = header_be32(lb, 0);
+            push_chunk(lb);
+            expect(lb, STATE_READ_ACK, 1);
+            break;
+
+        case STATE_READ_ACK:
+            lb->remaining -= lb->chunk;
+            if (lb->remaining > 0) {
+                push_chunk(lb);
+                expect(lb, STATE_READ_ACK, 1);
+            } else {
+                expect(lb, STATE_IDLE, 1);
+            }
+            break;
+
+        case STATE_WRITE_HEADER:
+            lb->remaining = header_be64(lb, 10);
+            lb->packet_length = header_be32(lb, 18);
+            push_reply8(lb, MTK_DA_ACK);
+            expect(lb, STATE_WRITE_ACK, 1);
+            break;
+
+        case STATE_WRITE_ACK:
+            lb->chunk = lb->remaining < lb->packet_length ? lb->remaining : lb->packet_length;
+            lb->skip = lb->chunk;
+            expect(lb, STATE_WRITE_DATA, 0);
+            break;
+
+        case STATE_WRITE_DATA:
+            expect(lb, STATE_WRITE_CHKSUM, 2);
+            break;
+
+        case STATE_WRITE_CHKSUM:
+            lb->remaining -= lb->chunk;
+            push_reply8(lb, MTK_DA_CONT_CHAR);
+            expect(lb, lb->remaining > 0 ? STATE_WRITE_ACK : STATE_IDLE, 1);
+            break;
+    }
+}
+
+static void consume(struct loopback *lb, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        if (lb->skip > 0) {
+            size_t n = len < lb->skip ? len : lb->skip;
+            lb->skip -= n;
+            data += n;
+            len -= n;
+
+            if (lb->skip == 0) {
+                step(lb);
+            }
+            continue;
+        }
+
+        lb->header[lb->header_len++] = *data++;
+        len--;
+
+        if (lb->header_len == lb->header_need) {
+            step(lb);
+        }
+    }
+}
+
+static int loopback_bulk_transfer(void *ctx, uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout) {
+    (void) timeout;
+
+    struct loopback *lb = ctx;
+
+    if (!(endpoint & LIBUSB_ENDPOINT_IN)) {
+        if (!lb->raw) {
+            consume(lb, data, length);
+        }
+        *transferred = length;
+        return 0;
+    }
+
+    if (lb->raw) {
+        size_t n = (size_t) length < sizeof(lb->pattern) ? (size_t) length : sizeof(lb->pattern);
+        memcpy(data, lb->pattern, n);
+        *transferred = n;
+        return 0;
+    }
+
+    if (lb->segments_count == 0) {
+        *transferred = 0;
+        return LIBUSB_ERROR_TIMEOUT;
+    }
+
+    /* Like the device, a transfer never spans two replies */
+    struct loopback_segment *segment = &lb->segments[0];
+    size_t n = (size_t) length < segment->len ? (size_t) length : segment->len;
+    memcpy(data, segment->data, n);
+    segment->data += n;
+    segment->len -= n;
+
+    if (segment->len == 0) {
+        lb->segments_count--;
+        memmove(&lb->segments[0], &lb->segments[1], lb->segments_count * sizeof(lb->segments[0]));
+    }
+
+    *transferred = n;
+    return 0;
+}
+
+static int loopback_control_transfer(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout) {
+    (void) ctx;
+    (void) request_type;
+    (void) request;
+    (void) value;
+    (void) index;
+    (void) data;
+    (void) timeout;
+
+    return length;
+}
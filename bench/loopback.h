@@ -0,0 +1,49 @@
+#ifndef LOOPBACK_H
+#define LOOPBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+#define LOOPBACK_PATTERN_SIZE (0x100000)
+
+#define LOOPBACK_MAX_SEGMENTS (4)
+
+struct loopback_segment {
+    const uint8_t *data;
+    size_t len;
+};
+
+/* In-memory device emulating the DA side of the read and write commands */
+struct loopback {
+    /* Answer every IN transfer with a full packet, instead of emulating the DA */
+    bool raw;
+
+    uint8_t pattern[LOOPBACK_PATTERN_SIZE];
+    uint16_t pattern_chksum;
+
+    int state;
+    uint8_t header[32];
+    size_t header_len;
+    size_t header_need;
+    size_t skip;
+
+    uint64_t remaining;
+    uint32_t packet_length;
+    size_t chunk;
+
+    uint8_t reply[4];
+    struct loopback_segment segments[LOOPBACK_MAX_SEGMENTS];
+    size_t segments_count;
+};
+
+extern const mtk_transport loopback_transport;
+
+void loopback_init(struct loopback *lb, bool raw);
+
+uint64_t bench_now(void);
+void bench_report(const char *name, uint64_t bytes, uint64_t ns);
+
+#endif /* LOOPBACK_H */
@@ -3,24 +3,56 @@
 #include <argp.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "util.h"
+
+#include "mtk_da.h"
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state);
+static void add_operation(struct arguments *arguments, int key, uint64_t address, uint64_t length, const char *path, const struct argp_state *state);
+static void parse_job_manifest(struct arguments *arguments, const char *path, const struct argp_state *state);
+static int operation_flags(int key);
+static const char *operation_verb(int key);
+static int open_operation_file(struct arguments *arguments, int key, const char *arg, const struct argp_state *state);
+static bool parse_uint64(const char *str, uint64_t *value);
 static uint64_t parse_uint64_opt(int key, const char *str, const struct argp_state *state);
 
 static const struct argp_option options[] = {
-    { "da-stage2",      '2',  NULL,     0, "Device is in DA Stage 2", 0 },
-    { "preloader",      'P',  NULL,     0, "Device is in Preloader mode", 0 },
-    { "download-agent", 'd', "FILE",    0, "Path to MediaTek Download Agent binary", 1 },
-    { "address",        'a', "ADDRESS", 0, "EMMC address to read/write", 2 },
-    { "length",         'l', "LENGTH",  0, "Length of data to read/write", 2 },
-    { "dump",           'D', "FILE",    0, "Path to dump data to", 3 },
-    { "flash",          'F', "FILE",    0, "Path to flash data from", 3 },
-    { "reboot",         'R',  NULL,     0, "Reboot device after completion", 4 },
-    { "verbose",        'v',  NULL,     0, "Produce verbose output", -1 },
-    {  NULL,             0,   NULL,     0,  NULL, 0 },
+    { "da-stage2",        '2',  NULL,     0, "Device is in DA Stage 2", 0 },
+    { "preloader",        'P',  NULL,     0, "Device is in Preloader mode", 0 },
+    { "probe",            'p',  NULL,     0, "Probe whether the DA is already running, and skip its upload if so", 0 },
+    { "wait",             'w', "SECONDS", 0, "Give up if no device is attached within SECONDS", 0 },
+    { "download-agent",   'd', "FILE",    0, "Path to MediaTek Download Agent binary", 1 },
+    { "address",          'a', "ADDRESS", 0, "EMMC address to read/write", 2 },
+    { "length",           'l', "LENGTH",  0, "Length of data to read/write", 2 },
+    { "erase-group",      'E', "SIZE",    0, "EMMC erase group size that flash writes are aligned to, or 0 to disable (default 512 KiB)", 2 },
+    { "dump",             'D', "FILE",    0, "Path to dump data to, or - for standard output", 3 },
+    { "flash",            'F', "FILE",    0, "Path to flash data from, or - for standard input", 3 },
+    { "verify",           'V', "FILE",    0, "Path to compare data against, without writing", 3 },
+    { "backup",           'B', "FILE",    0, "Path to write a backup recipe to, storing data in the chunk store", 3 },
+    { "image",            'I', "FILE",    0, "Path to image BOOT1, BOOT2 and USER to, sizes are taken from the DA", 3 },
+    { "nbd",              'N', "SOCKET",  0, "Serve EMMC read-only over NBD on a Unix socket, the whole USER area without a length", 3 },
+    { "job",              'J', "FILE",    0, "Read operations from FILE, one 'OPERATION ADDRESS LENGTH PATH' per line, where OPERATION is dump, flash, verify, backup, image or nbd", 3 },
+    { "store",            'S', "DIR",     0, "Chunk store for deduplicated backups", 4 },
+    { "reboot",           'R',  NULL,     0, "Reboot device after completion", 4 },
+    { "manifest",         'H',  NULL,     0, "Hash dumps while they stream, writing FILE.manifest with a Merkle root", 4 },
+    { "journal",          'j',  NULL,     0, "Journal dump/flash progress, and resume from an existing journal", 4 },
+    { "erase-zeros",      'z',  NULL,     0, "Erase zero ranges of seekable flash input with the DA instead of writing them", 4 },
+    { "allocated-only",   'A',  NULL,     0, "Dump only the blocks in use by the ext4 filesystem at the start of the range, as a sparse file", 4 },
+    { "encrypt-key",      'K', "FILE",    0, "Encrypt dumps and decrypt flash input with AES-256-GCM, using the 32 byte key in FILE, raw or as hex", 4 },
+    { "telemetry",        'T', "FILE",    0, "Write session telemetry as JSON to FILE", -1 },
+    { "capture",          'C', "FILE",    0, "Capture all USB transfers to FILE", -1 },
+    { "capture-full",     'c',  NULL,     0, "Capture full payloads, as needed for replay", -1 },
+    { "replay",           'r', "FILE",    0, "Replay a captured session instead of using a device", -1 },
+    { "replay-realtime",  't',  NULL,     0, "Keep the captured transfer durations when replaying", -1 },
+    { "machine-readable", 'M',  NULL,     0, "Print machine-readable progress lines", -1 },
+    { "verbose",          'v',  NULL,     0, "Produce verbose output", -1 },
+    {  NULL,               0,   NULL,     0,  NULL, 0 },
 };
 
 static const struct argp argp = {
@@ -40,7 +72,8 @@ void args_parse(int argc, char **argv, struct arguments *arguments) {
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     struct arguments *arguments = state->input;
-    bool flashing;
+    uint64_t seconds;
+    int err;
 
     switch (key) {
         case ARGP_KEY_INIT:
@@ -48,9 +81,26 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             arguments->download_agent = NULL;
             arguments->address = 0;
             arguments->length = 0;
+            arguments->wait = 0;
+            arguments->erase_group = MTK_DA_EMMC_ERASE_GROUP;
             arguments->reboot = false;
+            arguments->journal = false;
+            arguments->erase_zeros = false;
+            arguments->allocated_only = false;
+            arguments->manifest = false;
+            arguments->encrypted = false;
+            arguments->stdout_data = false;
+            arguments->store = NULL;
             arguments->verbose = false;
+            arguments->machine_readable = false;
+            arguments->telemetry = NULL;
+            arguments->capture = NULL;
+            arguments->capture_full = false;
+            arguments->replay = NULL;
+            arguments->replay_original_timing = false;
+            arguments->operations = NULL;
             arguments->operations_count = 0;
+            arguments->operations_capacity = 0;
             arguments->download_agent_fd = -1;
             break;
 
@@ -60,6 +110,16 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'P':
             arguments->state = DEVICE_STATE_PRELOADER;
             break;
+        case 'p':
+            arguments->state = DEVICE_STATE_AUTO;
+            break;
+        case 'w':
+            seconds = parse_uint64_opt(key, arg, state);
+            if (seconds > UINT_MAX / 1000) {
+                argp_error(state, "Wait is too long");
+            }
+            arguments->wait = seconds * 1000;
+            break;
         case 'd':
             arguments->download_agent = arg;
             break;
@@ -69,54 +129,71 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 'l':
             arguments->length = parse_uint64_opt(key, arg, state);
             break;
+        case 'E':
+            arguments->erase_group = parse_uint64_opt(key, arg, state);
+            if (arguments->erase_group % 512 != 0) {
+                argp_error(state, "Erase group must be a multiple of the 512 byte write block");
+            }
+            if (arguments->erase_group != 0 && MTK_DA_CHUNK_SIZE % arguments->erase_group != 0 && arguments->erase_group % MTK_DA_CHUNK_SIZE != 0) {
+                argp_error(state, "Erase group must divide the 1 MiB transfer chunk or be a multiple of it");
+            }
+            break;
         case 'R':
             arguments->reboot = true;
             break;
+        case 'j':
+            arguments->journal = true;
+            break;
+        case 'z':
+            arguments->erase_zeros = true;
+            break;
+        case 'A':
+            arguments->allocated_only = true;
+            break;
+        case 'H':
+            arguments->manifest = true;
+            break;
+        case 'K':
+            if ((err = encryption_load_key(arg, arguments->encryption_key)) < 0) {
+                argp_failure(state, 1, -err, "Unable to load encryption key");
+            }
+            arguments->encrypted = true;
+            break;
+        case 'S':
+            arguments->store = arg;
+            break;
         case 'v':
             arguments->verbose = true;
             break;
+        case 'M':
+            arguments->machine_readable = true;
+            break;
+        case 'T':
+            arguments->telemetry = arg;
+            break;
+        case 'C':
+            arguments->capture = arg;
+            break;
+        case 'c':
+            arguments->capture_full = true;
+            break;
+        case 'r':
+            arguments->replay = arg;
+            break;
+        case 't':
+            arguments->replay_original_timing = true;
+            break;
 
+        case 'B':
         case 'D':
         case 'F':
-            flashing = (key == 'F');
-
-            if (arguments->operations_count == MAX_OPERATIONS) {
-                argp_error(state, "Too many operations");
-            }
-            if (arguments->length == 0) {
-                argp_error(state, "Cannot perform zero-length operation");
-            }
-
-            struct operation *operation = &arguments->operations[arguments->operations_count++];
-
-            operation->key = key;
-            operation->address = arguments->address;
-            operation->length = arguments->length;
-
-            int flags;
-            const char *verb;
-
-            if (flashing) {
-                flags = O_RDONLY;
-                verb = "flashing";
-            } else {
-                flags = O_WRONLY | O_CREAT | O_TRUNC;
-                verb = "dumping";
-            }
-
-            if ((operation->fd = open(arg, flags, DEFFILEMODE)) < 0) {
-                argp_failure(state, 1, errno, "Unable to open file for %s: %s", verb, arg);
-            }
-
-            if (flashing) {
-                off_t maxlength;
-                if ((maxlength = lseek(operation->fd, 0, SEEK_END)) < 0) {
-                    argp_failure(state, 1, errno, "Unable to seek file descriptor: %s", arg);
-                }
-                if ((uint64_t) maxlength < arguments->length) {
-                    argp_failure(state, 1, 0, "Write length is greater than file size: %s", arg);
-                }
-            }
+        case 'I':
+        case 'N':
+        case 'V':
+            add_operation(arguments, key, arguments->address, arguments->length, arg, state);
+            break;
+        case 'J':
+            parse_job_manifest(arguments, arg, state);
             break;
 
         case ARGP_KEY_ARG:
@@ -124,34 +201,282 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             break;
 
         case ARGP_KEY_END:
-            if (arguments->state != DEVICE_STATE_DA_STAGE2) {
-                if (arguments->download_agent == NULL) {
-                    argp_error(state, "MediaTek Download Agent binary is mandatory, unless device is in DA Stage 2");
-                }
+            /* When probing, the DA is only needed if the probe finds the Preloader */
+            if (arguments->state != DEVICE_STATE_AUTO && arguments->state != DEVICE_STATE_DA_STAGE2 && arguments->download_agent == NULL) {
+                argp_error(state, "MediaTek Download Agent binary is mandatory, unless device is in DA Stage 2");
+            }
+            if (arguments->state != DEVICE_STATE_DA_STAGE2 && arguments->download_agent != NULL) {
                 if ((arguments->download_agent_fd = open(arguments->download_agent, O_RDONLY)) < 0) {
                     argp_failure(state, 1, errno, "Unable to open Download Agent binary");
                 }
             }
+            if (arguments->erase_zeros && arguments->journal) {
+                argp_error(state, "Erasing zero ranges cannot be combined with journaling");
+            }
+            if (arguments->encrypted && (arguments->journal || arguments->erase_zeros)) {
+                argp_error(state, "Encryption cannot be combined with journaling or erasing zero ranges");
+            }
+            /* The manifest hashes the plaintext, which would confirm guesses about the encrypted data */
+            if (arguments->encrypted && arguments->manifest) {
+                argp_error(state, "Encryption cannot be combined with manifests");
+            }
+            if (arguments->allocated_only && (arguments->journal || arguments->manifest || arguments->encrypted)) {
+                argp_error(state, "Dumping allocated blocks cannot be combined with journaling, manifests or encryption");
+            }
+            for (size_t i = 0; i < arguments->operations_count; i++) {
+                int op = arguments->operations[i].key;
+                if (operation_needs_report(&arguments->operations[i]) && arguments->state == DEVICE_STATE_DA_STAGE2) {
+                    argp_error(state, "Device images and NBD exports without a length require the DA report, which is only sent with the DA");
+                }
+                if (arguments->encrypted && op != 'D' && op != 'F') {
+                    argp_error(state, "Encryption only applies to dump and flash operations");
+                }
+                if (arguments->allocated_only && op == 'D' && strcmp(arguments->operations[i].path, "-") == 0) {
+                    argp_error(state, "Sparse dumps are written out of order, which requires a path");
+                }
+                if (op == 'B' && arguments->store == NULL) {
+                    argp_error(state, "Backup requires a chunk store");
+                }
+                if ((arguments->journal || arguments->manifest) && strcmp(arguments->operations[i].path, "-") == 0) {
+                    argp_error(state, "Journals and manifests are written next to the output, which requires a path");
+                }
+            }
             break;
     }
 
     return 0;
 }
 
-static uint64_t parse_uint64_opt(int key, const char *str, const struct argp_state *state) {
-    if (isdigit(*str)) {
-        char *endptr = NULL;
+static void add_operation(struct arguments *arguments, int key, uint64_t address, uint64_t length, const char *path, const struct argp_state *state) {
+    if (key == 'I') {
+        /* Sizes are taken from the DA report */
+        address = 0;
+        length = 0;
+    } else if (key != 'N' && length == 0) {
+        argp_error(state, "Cannot perform zero-length operation");
+    }
+
+    if (arguments->operations_count == arguments->operations_capacity) {
+        size_t capacity = MAX(arguments->operations_capacity * 2, (size_t) 16);
 
-        _Static_assert(ULLONG_MAX == UINT64_MAX, "unsigned long long is incompatible with uint64_t");
+        struct operation *operations;
+        if ((operations = realloc(arguments->operations, capacity * sizeof(*operations))) == NULL) {
+            argp_failure(state, 1, errno, "Unable to allocate operations");
+        }
+
+        arguments->operations = operations;
+        arguments->operations_capacity = capacity;
+    }
 
-        errno = 0;
-        uint64_t value = strtoull(str, &endptr, 0);
+    struct operation *operation = &arguments->operations[arguments->operations_count++];
 
-        if (errno == 0 && *endptr == '\0') {
-            return value;
+    operation->key = key;
+    operation->address = address;
+    operation->length = length;
+    operation->path = path;
+    operation->fd = -1;
+
+    /* Files are opened when the operation runs, so only input is checked here */
+    bool stdio = (strcmp(path, "-") == 0);
+    if (key == 'N' || (!stdio && key != 'F' && key != 'V')) {
+        return;
+    }
+
+    int fd = open_operation_file(arguments, key, path, state);
+
+    /* Pipes cannot be checked up front, short input is detected while flashing instead */
+    off_t maxlength;
+    if ((maxlength = lseek(fd, 0, SEEK_END)) < 0) {
+        if (errno != ESPIPE) {
+            argp_failure(state, 1, errno, "Unable to seek file descriptor: %s", path);
+        }
+        if (key == 'V') {
+            argp_failure(state, 1, 0, "Verification requires a seekable file: %s", path);
+        }
+        if (key == 'I') {
+            argp_failure(state, 1, 0, "Device image requires a seekable file: %s", path);
         }
+    } else if ((key == 'F' || key == 'V') && (uint64_t) maxlength < length) {
+        argp_failure(state, 1, 0, "Length is greater than file size: %s", path);
+    }
+
+    if (stdio) {
+        operation->fd = fd;
+    } else {
+        close(fd);
+    }
+}
+
+static void parse_job_manifest(struct arguments *arguments, const char *path, const struct argp_state *state) {
+    FILE *fp;
+    if ((fp = fopen(path, "r")) == NULL) {
+        argp_failure(state, 1, errno, "Unable to open job manifest: %s", path);
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    size_t lineno = 0;
+
+    ssize_t n;
+    while ((n = getline(&line, &size, fp)) >= 0) {
+        lineno++;
+
+        if (n > 0 && line[n - 1] == '\n') {
+            line[--n] = '\0';
+        }
+
+        char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        /* The path is the rest of the line, so it may contain spaces */
+        char name[16], address[32], length[32];
+        int consumed = 0;
+        if (sscanf(p, "%15s %31s %31s %n", name, address, length, &consumed) != 3 || p[consumed] == '\0') {
+            argp_failure(state, 1, 0, "%s:%zu: Expected OPERATION ADDRESS LENGTH PATH", path, lineno);
+        }
+
+        int key = 0;
+        for (const struct argp_option *option = options; option->name != NULL; option++) {
+            if (strcmp(option->name, name) == 0 && option->key != 0 && strchr("BDFINV", option->key) != NULL) {
+                key = option->key;
+                break;
+            }
+        }
+        if (key == 0) {
+            argp_failure(state, 1, 0, "%s:%zu: Unknown operation: %s", path, lineno, name);
+        }
+
+        uint64_t address_value, length_value;
+        if (!parse_uint64(address, &address_value) || !parse_uint64(length, &length_value)) {
+            argp_failure(state, 1, 0, "%s:%zu: Address and length must be integers", path, lineno);
+        }
+        if (key != 'I' && key != 'N' && length_value == 0) {
+            argp_failure(state, 1, 0, "%s:%zu: Cannot perform zero-length operation", path, lineno);
+        }
+
+        char *operation_path;
+        if ((operation_path = strdup(p + consumed)) == NULL) {
+            argp_failure(state, 1, errno, "Unable to allocate operations");
+        }
+
+        add_operation(arguments, key, address_value, length_value, operation_path, state);
+    }
+
+    if (ferror(fp)) {
+        argp_failure(state, 1, errno, "Unable to read job manifest: %s", path);
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+static int operation_flags(int key) {
+    switch (key) {
+        case 'F':
+        case 'V':
+            return O_RDONLY;
+        case 'D':
+            /* Truncated once the operation starts, and read back to validate a journal before resuming */
+            return O_RDWR | O_CREAT;
+        default:
+            return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+}
+
+static const char *operation_verb(int key) {
+    switch (key) {
+        case 'F':
+            return "flashing";
+        case 'V':
+            return "verifying";
+        case 'D':
+            return "dumping";
+        case 'B':
+            return "backup";
+        default:
+            return "imaging";
+    }
+}
+
+static int open_operation_file(struct arguments *arguments, int key, const char *arg, const struct argp_state *state) {
+    int flags = operation_flags(key);
+    int fd;
+
+    if (strcmp(arg, "-") == 0) {
+        if ((flags & O_ACCMODE) == O_RDONLY) {
+            return STDIN_FILENO;
+        }
+
+        /* Standard output is handed over to the data, messages are moved to standard error */
+        if ((fd = dup(STDOUT_FILENO)) < 0) {
+            argp_failure(state, 1, errno, "Unable to duplicate standard output");
+        }
+        arguments->stdout_data = true;
+        return fd;
+    }
+
+    if ((fd = open(arg, flags, DEFFILEMODE)) < 0) {
+        argp_failure(state, 1, errno, "Unable to open file for %s: %s", operation_verb(key), arg);
+    }
+
+    return fd;
+}
+
+static bool parse_uint64(const char *str, uint64_t *value) {
+    if (!isdigit(*str)) {
+        return false;
+    }
+
+    char *endptr = NULL;
+
+    _Static_assert(ULLONG_MAX == UINT64_MAX, "unsigned long long is incompatible with uint64_t");
+
+    errno = 0;
+    *value = strtoull(str, &endptr, 0);
+
+    return errno == 0 && *endptr == '\0';
+}
+
+static uint64_t parse_uint64_opt(int key, const char *str, const struct argp_state *state) {
+    uint64_t value;
+    if (parse_uint64(str, &value)) {
+        return value;
     }
 
     argp_error(state, "option requires an integer -- '%c'", key);
     return 0;
 }
+
+int operation_open(struct operation *operation) {
+    if (operation->fd >= 0 || operation->key == 'N') {
+        return 0;
+    }
+
+    int fd;
+    if ((fd = open(operation->path, operation_flags(operation->key), DEFFILEMODE)) < 0) {
+        return -errno;
+    }
+
+    if (operation->key == 'I' && lseek(fd, 0, SEEK_CUR) < 0) {
+        close(fd);
+        return -ESPIPE;
+    }
+
+    operation->fd = fd;
+
+    return 0;
+}
+
+void operation_close(struct operation *operation) {
+    /* Standard input is shared by every operation reading from it */
+    if (operation->fd > STDERR_FILENO) {
+        close(operation->fd);
+    }
+    operation->fd = -1;
+}
+
+bool operation_needs_report(const struct operation *operation) {
+    return operation->key == 'I' || (operation->key == 'N' && operation->length == 0);
+}
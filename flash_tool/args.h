@@ -5,9 +5,11 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define MAX_OPERATIONS (64)
+#include "encryption.h"
 
 enum device_state {
+    /* Probed once the device is attached, only when asked to */
+    DEVICE_STATE_AUTO,
     DEVICE_STATE_NONE,
     DEVICE_STATE_PRELOADER,
     DEVICE_STATE_DA_STAGE2,
@@ -17,6 +19,8 @@ struct operation {
     int key;
     uint64_t address;
     uint64_t length;
+    const char *path;
+    /* Opened while the operation runs, unless it streams through standard I/O */
     int fd;
 };
 
@@ -25,15 +29,43 @@ struct arguments {
     const char *download_agent;
     uint64_t address;
     uint64_t length;
+    /* Flash writes are aligned to it, 0 disables alignment */
+    uint64_t erase_group;
+    /* Milliseconds to wait for a device to attach, 0 waits forever */
+    unsigned int wait;
     bool reboot;
+    bool journal;
+    bool erase_zeros;
+    /* Dumps of ext4 filesystems only read allocated blocks, into sparse files */
+    bool allocated_only;
+    bool manifest;
+    /* Dumps are encrypted and flash input decrypted with the key from -K */
+    bool encrypted;
+    uint8_t encryption_key[ENCRYPTION_KEY_SIZE];
+    /* Some operation streams through standard output */
+    bool stdout_data;
+    const char *store;
     bool verbose;
+    bool machine_readable;
+    const char *telemetry;
+    const char *capture;
+    bool capture_full;
+    const char *replay;
+    bool replay_original_timing;
 
-    struct operation operations[MAX_OPERATIONS];
+    struct operation *operations;
     size_t operations_count;
+    size_t operations_capacity;
 
     int download_agent_fd;
 };
 
 void args_parse(int argc, char **argv, struct arguments *arguments);
 
+/* Device images and NBD exports without a length are sized from the DA report */
+bool operation_needs_report(const struct operation *operation);
+
+int operation_open(struct operation *operation);
+void operation_close(struct operation *operation);
+
 #endif /* ARGS_H */
@@ -0,0 +1,241 @@
+#include "block_cache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "mtk_da.h"
+
+#include "util.h"
+
+#define NIL (UINT32_MAX)
+
+struct fetch_info {
+    struct block_cache *cache;
+    uint32_t entries[BLOCK_CACHE_MAX_READAHEAD];
+};
+
+static uint32_t lookup(const struct block_cache *cache, uint64_t block);
+static uint32_t evict(struct block_cache *cache, uint64_t block);
+static void touch(struct block_cache *cache, uint32_t index);
+static void insert(struct block_cache *cache, uint32_t index);
+static int fetch(struct block_cache *cache, uint64_t first, size_t count);
+static int fetch_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+int block_cache_init(struct block_cache *cache, mtk_device *device, uint64_t address, uint64_t length) {
+    cache->device = device;
+    cache->address = address;
+    cache->length = length;
+    cache->next_block = UINT64_MAX;
+    cache->readahead = 1;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->fetched = 0;
+    cache->error = 0;
+
+    for (size_t i = 0; i < 2 * BLOCK_CACHE_BLOCKS; i++) {
+        cache->buckets[i] = NIL;
+    }
+
+    for (uint32_t i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        struct cache_block *entry = &cache->blocks[i];
+
+        if ((entry->data = malloc(BLOCK_CACHE_BLOCK_SIZE)) == NULL) {
+            int err = -errno;
+            while (i-- > 0) {
+                free(cache->blocks[i].data);
+            }
+            return err;
+        }
+
+        entry->valid = false;
+        entry->lru_prev = (i == 0) ? NIL : i - 1;
+        entry->lru_next = (i + 1 == BLOCK_CACHE_BLOCKS) ? NIL : i + 1;
+        entry->hash_next = NIL;
+    }
+
+    cache->lru_head = 0;
+    cache->lru_tail = BLOCK_CACHE_BLOCKS - 1;
+
+    return 0;
+}
+
+void block_cache_finish(struct block_cache *cache) {
+    for (size_t i = 0; i < BLOCK_CACHE_BLOCKS; i++) {
+        free(cache->blocks[i].data);
+    }
+}
+
+int block_cache_read(struct block_cache *cache, uint64_t offset, uint8_t *buffer, size_t count) {
+    if (offset > cache->length || count > cache->length - offset) {
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t first = offset / BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t last = (offset + count - 1) / BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t blocks = (cache->length + BLOCK_CACHE_BLOCK_SIZE - 1) / BLOCK_CACHE_BLOCK_SIZE;
+
+    /* Grow the window while access stays sequential, and drop back to single blocks otherwise */
+    if (first == cache->next_block || first + 1 == cache->next_block) {
+        cache->readahead = MIN(cache->readahead * 2, BLOCK_CACHE_MAX_READAHEAD);
+    } else {
+        cache->readahead = 1;
+    }
+    cache->next_block = last + 1;
+
+    int err;
+
+    for (uint64_t block = first; block <= last; block++) {
+        uint32_t index = lookup(cache, block);
+
+        if (index == NIL) {
+            cache->misses++;
+
+            /* Fetch the rest of the request and the readahead window in one read, stopping at cached blocks */
+            size_t n = 1;
+            size_t want = MAX((size_t) (last - block + 1), cache->readahead);
+            while (n < want && n < BLOCK_CACHE_MAX_READAHEAD && block + n < blocks && lookup(cache, block + n) == NIL) {
+                n++;
+            }
+
+            if ((err = fetch(cache, block, n)) < 0) {
+                if (cache->error == 0) {
+                    cache->error = err;
+                }
+                return err;
+            }
+
+            index = lookup(cache, block);
+        } else {
+            cache->hits++;
+        }
+
+        touch(cache, index);
+
+        uint64_t start = block * BLOCK_CACHE_BLOCK_SIZE;
+        size_t from = (offset > start) ? offset - start : 0;
+        size_t to = MIN((uint64_t) BLOCK_CACHE_BLOCK_SIZE, offset + count - start);
+
+        memcpy(buffer, cache->blocks[index].data + from, to - from);
+        buffer += to - from;
+    }
+
+    return 0;
+}
+
+static uint32_t lookup(const struct block_cache *cache, uint64_t block) {
+    uint32_t index = cache->buckets[block % (2 * BLOCK_CACHE_BLOCKS)];
+
+    while (index != NIL && cache->blocks[index].block != block) {
+        index = cache->blocks[index].hash_next;
+    }
+
+    return index;
+}
+
+static uint32_t evict(struct block_cache *cache, uint64_t block) {
+    uint32_t index = cache->lru_tail;
+    struct cache_block *entry = &cache->blocks[index];
+
+    /* Only valid entries are hashed */
+    if (entry->valid) {
+        uint32_t *link = &cache->buckets[entry->block % (2 * BLOCK_CACHE_BLOCKS)];
+        while (*link != index) {
+            link = &cache->blocks[*link].hash_next;
+        }
+        *link = entry->hash_next;
+    }
+
+    /* Not valid or hashed until the fetch completes, so a failed fetch leaves it unused */
+    entry->valid = false;
+    entry->block = block;
+    entry->hash_next = NIL;
+
+    touch(cache, index);
+
+    return index;
+}
+
+static void insert(struct block_cache *cache, uint32_t index) {
+    struct cache_block *entry = &cache->blocks[index];
+    uint32_t *bucket = &cache->buckets[entry->block % (2 * BLOCK_CACHE_BLOCKS)];
+
+    entry->hash_next = *bucket;
+    *bucket = index;
+    entry->valid = true;
+}
+
+static void touch(struct block_cache *cache, uint32_t index) {
+    struct cache_block *entry = &cache->blocks[index];
+
+    if (cache->lru_head == index) {
+        return;
+    }
+
+    /* Unlink, then insert at the head */
+    cache->blocks[entry->lru_prev].lru_next = entry->lru_next;
+    if (entry->lru_next != NIL) {
+        cache->blocks[entry->lru_next].lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = NIL;
+    entry->lru_next = cache->lru_head;
+    cache->blocks[cache->lru_head].lru_prev = index;
+    cache->lru_head = index;
+}
+
+static int fetch(struct block_cache *cache, uint64_t first, size_t count) {
+    struct fetch_info info = { .cache = cache };
+
+    for (size_t i = 0; i < count; i++) {
+        info.entries[i] = evict(cache, first + i);
+    }
+
+    uint64_t start = first * BLOCK_CACHE_BLOCK_SIZE;
+    uint64_t length = MIN((uint64_t) count * BLOCK_CACHE_BLOCK_SIZE, cache->length - start);
+
+    uint8_t retval;
+    int err = mtk_da_read(cache->device, MTK_DA_HW_STORAGE_EMMC, cache->address + start, length, &retval, fetch_handler, &info);
+    if (err == 0 && retval != MTK_DA_ACK) {
+        err = LIBUSB_ERROR_IO;
+    }
+    if (err < 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        insert(cache, info.entries[i]);
+    }
+    cache->fetched += length;
+
+    return 0;
+}
+
+static int fetch_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) flashing;
+    (void) total_length;
+
+    const struct fetch_info *info = user_data;
+
+    /* DA chunks and cache blocks are not the same size, scatter each chunk across blocks */
+    while (count > 0) {
+        size_t index = offset / BLOCK_CACHE_BLOCK_SIZE;
+        size_t from = offset % BLOCK_CACHE_BLOCK_SIZE;
+        size_t n = MIN(BLOCK_CACHE_BLOCK_SIZE - from, count);
+
+        memcpy(info->cache->blocks[info->entries[index]].data + from, buffer, n);
+
+        offset += n;
+        buffer += n;
+        count -= n;
+    }
+
+    return 0;
+}
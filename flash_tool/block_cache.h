@@ -0,0 +1,55 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+#define BLOCK_CACHE_BLOCK_SIZE ((size_t) 0x40000)
+#define BLOCK_CACHE_BLOCKS (256)
+/* Largest number of blocks fetched by a single read, once access is sequential */
+#define BLOCK_CACHE_MAX_READAHEAD ((size_t) 16)
+
+struct cache_block {
+    uint64_t block;
+    uint8_t *data;
+    bool valid;
+
+    uint32_t lru_prev;
+    uint32_t lru_next;
+    uint32_t hash_next;
+};
+
+struct block_cache {
+    mtk_device *device;
+    uint64_t address;
+    uint64_t length;
+
+    struct cache_block blocks[BLOCK_CACHE_BLOCKS];
+    uint32_t buckets[2 * BLOCK_CACHE_BLOCKS];
+
+    /* Most recently used at the head, evicted from the tail */
+    uint32_t lru_head;
+    uint32_t lru_tail;
+
+    /* Block following the previous request, and the current readahead window */
+    uint64_t next_block;
+    size_t readahead;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t fetched;
+
+    /* First error of a read from the device, which may have left the DA part way through a transfer */
+    int error;
+};
+
+int block_cache_init(struct block_cache *cache, mtk_device *device, uint64_t address, uint64_t length);
+void block_cache_finish(struct block_cache *cache);
+
+/* Fails with LIBUSB_ERROR_INVALID_PARAM for ranges past the end */
+int block_cache_read(struct block_cache *cache, uint64_t offset, uint8_t *buffer, size_t count);
+
+#endif /* BLOCK_CACHE_H */
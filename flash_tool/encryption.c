@@ -0,0 +1,363 @@
+#include "encryption.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/rand.h>
+
+#define IV_SIZE (12)
+
+struct encryption {
+    struct file_info *fi;
+    bool decrypt;
+    EVP_CIPHER_CTX *ctx;
+
+    /* As stored in the file, it is authenticated with every segment */
+    struct encryption_header header;
+    uint32_t segment_size;
+    uint64_t length;
+    /* Size of the whole file, the total length handed to io_handler */
+    uint64_t file_length;
+
+    /* Plaintext of one segment, followed by room for its tag */
+    uint8_t *segment;
+    uint64_t index;
+    size_t used;
+    bool loaded;
+};
+
+static int derive_key(const uint8_t *key, const uint8_t *salt, uint8_t *segment_key);
+static int read_at(struct encryption *encryption, uint64_t offset, uint8_t *buffer, size_t count);
+static int seal_segment(struct encryption *encryption);
+static int load_segment(struct encryption *encryption, uint64_t index);
+
+static int parse_hex(const char *str, size_t len, uint8_t *out) {
+    for (size_t i = 0; i < len; i++) {
+        char c = str[i];
+        int value;
+        if (c >= '0' && c <= '9') {
+            value = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value = c - 'A' + 10;
+        } else {
+            return -EINVAL;
+        }
+        out[i / 2] = (i % 2 == 0) ? value << 4 : (out[i / 2] | value);
+    }
+
+    return 0;
+}
+
+int encryption_load_key(const char *path, uint8_t *key) {
+    int fd;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return -errno;
+    }
+
+    /* Room for the hex form, a CRLF, and one more byte to detect longer files */
+    char buffer[2 * ENCRYPTION_KEY_SIZE + 3];
+    size_t len = 0;
+    int err = 0;
+
+    while (len < sizeof(buffer)) {
+        ssize_t n = read(fd, buffer + len, sizeof(buffer) - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            err = -errno;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+
+    close(fd);
+
+    if (err == 0) {
+        if (len == ENCRYPTION_KEY_SIZE) {
+            memcpy(key, buffer, ENCRYPTION_KEY_SIZE);
+        } else {
+            while (len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == '\r')) {
+                len--;
+            }
+            err = (len == 2 * ENCRYPTION_KEY_SIZE) ? parse_hex(buffer, len, key) : -EINVAL;
+        }
+    }
+
+    OPENSSL_cleanse(buffer, sizeof(buffer));
+
+    return err;
+}
+
+int encryption_init(struct encryption **encryption, struct file_info *fi, const uint8_t *key, bool decrypt, uint64_t length) {
+    struct encryption *ptr;
+    if ((ptr = calloc(1, sizeof(*ptr))) == NULL) {
+        return -errno;
+    }
+
+    ptr->fi = fi;
+    ptr->decrypt = decrypt;
+    ptr->length = length;
+
+    int err = 0;
+
+    if (decrypt) {
+        if ((err = read_at(ptr, 0, (uint8_t *) &ptr->header, sizeof(ptr->header))) < 0) {
+            goto fail;
+        }
+
+        ptr->segment_size = le32toh(ptr->header.segment_size);
+        if (memcmp(ptr->header.magic, ENCRYPTION_MAGIC, sizeof(ptr->header.magic)) != 0 || le32toh(ptr->header.version) != ENCRYPTION_VERSION) {
+            err = -EINVAL;
+            goto fail;
+        }
+        if (ptr->segment_size == 0 || ptr->segment_size > ENCRYPTION_MAX_SEGMENT_SIZE || le64toh(ptr->header.length) < length) {
+            err = -EINVAL;
+            goto fail;
+        }
+    } else {
+        memcpy(ptr->header.magic, ENCRYPTION_MAGIC, sizeof(ptr->header.magic));
+        ptr->header.version = htole32(ENCRYPTION_VERSION);
+        ptr->header.segment_size = htole32(ENCRYPTION_SEGMENT_SIZE);
+        ptr->header.length = htole64(length);
+        if (RAND_bytes(ptr->header.salt, sizeof(ptr->header.salt)) != 1) {
+            err = -EIO;
+            goto fail;
+        }
+
+        ptr->segment_size = ENCRYPTION_SEGMENT_SIZE;
+    }
+
+    uint64_t file_data = le64toh(ptr->header.length);
+    uint64_t segments = (file_data + ptr->segment_size - 1) / ptr->segment_size;
+    ptr->file_length = sizeof(ptr->header) + file_data + segments * ENCRYPTION_TAG_SIZE;
+
+    if ((ptr->segment = malloc(ptr->segment_size + ENCRYPTION_TAG_SIZE)) == NULL) {
+        err = -errno;
+        goto fail;
+    }
+
+    uint8_t segment_key[ENCRYPTION_KEY_SIZE];
+    if ((err = derive_key(key, ptr->header.salt, segment_key)) == 0) {
+        /* The key is set once, each segment only changes the IV */
+        if ((ptr->ctx = EVP_CIPHER_CTX_new()) == NULL || EVP_CipherInit_ex(ptr->ctx, EVP_aes_256_gcm(), NULL, segment_key, NULL, !decrypt) != 1) {
+            err = -EIO;
+        }
+    }
+    OPENSSL_cleanse(segment_key, sizeof(segment_key));
+    if (err < 0) {
+        goto fail;
+    }
+
+    if (!decrypt && (err = io_handler(false, 0, ptr->file_length, (uint8_t *) &ptr->header, sizeof(ptr->header), fi)) < 0) {
+        goto fail;
+    }
+
+    *encryption = ptr;
+
+    return 0;
+
+fail:
+    EVP_CIPHER_CTX_free(ptr->ctx);
+    free(ptr->segment);
+    free(ptr);
+
+    return err;
+}
+
+int encryption_finish(struct encryption *encryption) {
+    int err = 0;
+
+    if (!encryption->decrypt && (encryption->used != 0 || encryption->index * encryption->segment_size < encryption->length)) {
+        /* Stream ended early, the last segment was never sealed */
+        err = -EIO;
+    }
+
+    OPENSSL_cleanse(encryption->segment, encryption->segment_size + ENCRYPTION_TAG_SIZE);
+    free(encryption->segment);
+    EVP_CIPHER_CTX_free(encryption->ctx);
+    free(encryption);
+
+    return err;
+}
+
+int encryption_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    struct encryption *encryption = user_data;
+
+    (void) total_length;
+
+    int err;
+
+    if (flashing != encryption->decrypt) {
+        /* Set up for the other direction */
+        return -EINVAL;
+    }
+
+    while (count > 0) {
+        uint64_t index = offset / encryption->segment_size;
+        size_t within = offset % encryption->segment_size;
+
+        if (flashing) {
+            /* -EBADMSG for a wrong key or a modified file */
+            if ((!encryption->loaded || encryption->index != index) && (err = load_segment(encryption, index)) < 0) {
+                return err;
+            }
+        } else if (index != encryption->index || within != encryption->used) {
+            /* Segments are sealed as they fill up, so dumps must arrive in order */
+            return -ESPIPE;
+        }
+
+        size_t n = encryption->segment_size - within;
+        if (n > count) {
+            n = count;
+        }
+
+        if (flashing) {
+            memcpy(buffer, encryption->segment + within, n);
+        } else {
+            memcpy(encryption->segment + within, buffer, n);
+            encryption->used += n;
+
+            if (encryption->used == encryption->segment_size || offset + n == encryption->length) {
+                if ((err = seal_segment(encryption)) < 0) {
+                    return err;
+                }
+            }
+        }
+
+        offset += n;
+        buffer += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int derive_key(const uint8_t *key, const uint8_t *salt, uint8_t *segment_key) {
+    EVP_PKEY_CTX *ctx;
+    if ((ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL)) == NULL) {
+        return -EIO;
+    }
+
+    size_t len = ENCRYPTION_KEY_SIZE;
+    bool ok = EVP_PKEY_derive_init(ctx) > 0
+        && EVP_PKEY_CTX_set_hkdf_md(ctx, EVP_sha256()) > 0
+        && EVP_PKEY_CTX_set1_hkdf_salt(ctx, salt, ENCRYPTION_SALT_SIZE) > 0
+        && EVP_PKEY_CTX_set1_hkdf_key(ctx, key, ENCRYPTION_KEY_SIZE) > 0
+        && EVP_PKEY_CTX_add1_hkdf_info(ctx, (const unsigned char *) ENCRYPTION_HKDF_INFO, strlen(ENCRYPTION_HKDF_INFO)) > 0
+        && EVP_PKEY_derive(ctx, segment_key, &len) > 0;
+
+    EVP_PKEY_CTX_free(ctx);
+
+    return ok ? 0 : -EIO;
+}
+
+/*
+ * Segments and their tags never line up with the read-ahead of the io_uring
+ * backend, which would read most of the file several times over. They are
+ * read directly instead, except from streams, which are read in order.
+ */
+static int read_at(struct encryption *encryption, uint64_t offset, uint8_t *buffer, size_t count) {
+    struct file_info *fi = encryption->fi;
+
+    if (fi->stream) {
+        return io_handler(true, offset, encryption->file_length, buffer, count, fi);
+    }
+
+    size_t done = 0;
+    while (done < count) {
+        ssize_t n = pread(fi->fd, buffer + done, count - done, fi->offset + offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -errno;
+        }
+        if (n == 0) {
+            /* Truncated file */
+            return -EIO;
+        }
+        done += n;
+    }
+
+    return 0;
+}
+
+static uint64_t segment_offset(const struct encryption *encryption, uint64_t index) {
+    return sizeof(encryption->header) + index * (encryption->segment_size + ENCRYPTION_TAG_SIZE);
+}
+
+/* Runs GCM over the segment in place, with the IV and AAD of segment index */
+static bool crypt_segment(struct encryption *encryption, uint64_t index, size_t count) {
+    uint8_t iv[IV_SIZE] = { 0 };
+    uint64_t le_index = htole64(index);
+    memcpy(iv + IV_SIZE - sizeof(le_index), &le_index, sizeof(le_index));
+
+    int len;
+    return EVP_CipherInit_ex(encryption->ctx, NULL, NULL, NULL, iv, -1) == 1
+        && EVP_CipherUpdate(encryption->ctx, NULL, &len, (const uint8_t *) &encryption->header, sizeof(encryption->header)) == 1
+        && EVP_CipherUpdate(encryption->ctx, encryption->segment, &len, encryption->segment, count) == 1;
+}
+
+static int seal_segment(struct encryption *encryption) {
+    size_t count = encryption->used;
+    uint8_t *tag = encryption->segment + count;
+
+    int len;
+    if (!crypt_segment(encryption, encryption->index, count)
+            || EVP_CipherFinal_ex(encryption->ctx, tag, &len) != 1
+            || EVP_CIPHER_CTX_ctrl(encryption->ctx, EVP_CTRL_GCM_GET_TAG, ENCRYPTION_TAG_SIZE, tag) != 1) {
+        return -EIO;
+    }
+
+    int err;
+    if ((err = io_handler(false, segment_offset(encryption, encryption->index), encryption->file_length, encryption->segment, count + ENCRYPTION_TAG_SIZE, encryption->fi)) < 0) {
+        return err;
+    }
+
+    encryption->index++;
+    encryption->used = 0;
+
+    return 0;
+}
+
+static int load_segment(struct encryption *encryption, uint64_t index) {
+    uint64_t length = le64toh(encryption->header.length);
+    uint64_t start = index * encryption->segment_size;
+    size_t count = (length - start < encryption->segment_size) ? length - start : encryption->segment_size;
+    uint8_t *tag = encryption->segment + count;
+
+    encryption->loaded = false;
+
+    int err;
+    if ((err = read_at(encryption, segment_offset(encryption, index), encryption->segment, count + ENCRYPTION_TAG_SIZE)) < 0) {
+        return err;
+    }
+
+    int len;
+    if (!crypt_segment(encryption, index, count)
+            || EVP_CIPHER_CTX_ctrl(encryption->ctx, EVP_CTRL_GCM_SET_TAG, ENCRYPTION_TAG_SIZE, tag) != 1) {
+        return -EIO;
+    }
+    if (EVP_CipherFinal_ex(encryption->ctx, tag, &len) != 1) {
+        /* Wrong key, or the file was modified */
+        return -EBADMSG;
+    }
+
+    encryption->index = index;
+    encryption->loaded = true;
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef ENCRYPTION_H
+#define ENCRYPTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io_handler.h"
+
+/*
+ * Encrypted files start with an encryption_header, followed by the data in
+ * segments of segment_size bytes (the last may be shorter), each sealed with
+ * AES-256-GCM and followed by its 16 byte tag. Segment i starts at
+ * sizeof(header) + i * (segment_size + 16), so it can be decrypted on its own.
+ *
+ * Every file has its own key, HKDF-SHA256 of the master key with the salt from
+ * the header and ENCRYPTION_HKDF_INFO. The IV of segment i is four zero bytes
+ * and i as a little-endian 64-bit integer, and the whole header is the
+ * additional authenticated data. All fields are little-endian.
+ */
+
+#define ENCRYPTION_MAGIC "MTKENC\r\n"
+#define ENCRYPTION_VERSION (1)
+#define ENCRYPTION_HKDF_INFO "MTKENC segment key"
+
+#define ENCRYPTION_KEY_SIZE (32)
+#define ENCRYPTION_SALT_SIZE (32)
+#define ENCRYPTION_TAG_SIZE (16)
+#define ENCRYPTION_SEGMENT_SIZE (0x100000)
+/* Largest segment accepted when decrypting */
+#define ENCRYPTION_MAX_SEGMENT_SIZE (0x1000000)
+
+struct encryption_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t segment_size;
+    uint64_t length;
+    uint8_t salt[ENCRYPTION_SALT_SIZE];
+    uint8_t reserved[8];
+} __attribute__((packed));
+
+struct encryption;
+
+/* Key files hold the key either raw, or as hex digits with an optional newline */
+int encryption_load_key(const char *path, uint8_t *key);
+
+/* Writes a new header when encrypting, reads and checks the existing one when decrypting */
+int encryption_init(struct encryption **encryption, struct file_info *fi, const uint8_t *key, bool decrypt, uint64_t length);
+/* Fails if an encrypted stream ended before the last segment was written */
+int encryption_finish(struct encryption *encryption);
+
+/* Encrypts dumped data into the file, or decrypts flash input from it, user_data is the encryption */
+/* Decrypting fails with -EBADMSG if the key is wrong or the file was modified */
+int encryption_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* ENCRYPTION_H */
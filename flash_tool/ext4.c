@@ -0,0 +1,401 @@
+#include "ext4.h"
+
+#include <endian.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mtk_da.h"
+
+#define SUPERBLOCK_OFFSET (1024)
+#define SUPERBLOCK_SIZE (1024)
+#define EXT4_MAGIC (0xef53)
+
+#define COMPAT_RESIZE_INODE (0x10)
+#define COMPAT_SPARSE_SUPER2 (0x200)
+#define INCOMPAT_RECOVER (0x4)
+#define INCOMPAT_META_BG (0x10)
+#define INCOMPAT_64BIT (0x80)
+#define RO_COMPAT_SPARSE_SUPER (0x1)
+#define RO_COMPAT_GDT_CSUM (0x10)
+#define RO_COMPAT_BIGALLOC (0x200)
+#define RO_COMPAT_METADATA_CSUM (0x400)
+
+#define BG_BLOCK_UNINIT (0x2)
+
+/* Most block bitmaps read by a single command, flex_bg keeps them next to each other */
+#define MAX_BITMAP_READ (256)
+
+struct superblock {
+    uint64_t blocks_count;
+    uint32_t block_size;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint64_t inode_table_blocks;
+    uint32_t desc_size;
+    uint32_t reserved_gdt_blocks;
+    bool sparse_super;
+    bool is_64bit;
+    /* Group descriptors are checksummed, so their flags can be trusted */
+    bool group_csum;
+
+    uint64_t groups;
+    uint64_t gdt_blocks;
+};
+
+struct group {
+    uint64_t block_bitmap;
+    uint64_t inode_bitmap;
+    uint64_t inode_table;
+    uint16_t flags;
+};
+
+static uint16_t get16(const uint8_t *data, size_t offset) {
+    uint16_t value;
+    memcpy(&value, data + offset, sizeof(value));
+    return le16toh(value);
+}
+
+static uint32_t get32(const uint8_t *data, size_t offset) {
+    uint32_t value;
+    memcpy(&value, data + offset, sizeof(value));
+    return le32toh(value);
+}
+
+static int memory_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) flashing;
+    (void) total_length;
+
+    memcpy((uint8_t *) user_data + offset, buffer, count);
+
+    return 0;
+}
+
+static int read_memory(mtk_device *device, uint64_t address, uint64_t length, uint8_t *data) {
+    uint8_t retval;
+    int err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, address, length, &retval, memory_handler, data);
+    if (err == 0 && retval != MTK_DA_ACK) {
+        err = LIBUSB_ERROR_IO;
+    }
+
+    return err;
+}
+
+static const char *parse_superblock(struct superblock *sb, const uint8_t *raw, uint64_t length) {
+    if (get16(raw, 0x38) != EXT4_MAGIC) {
+        return "No ext4 filesystem found";
+    }
+
+    uint32_t compat = get32(raw, 0x5c);
+    uint32_t incompat = get32(raw, 0x60);
+    uint32_t ro_compat = get32(raw, 0x64);
+
+    /* Blocks of committed transactions are only in the bitmaps once the journal is replayed */
+    if (incompat & INCOMPAT_RECOVER) {
+        return "Filesystem needs journal recovery";
+    }
+
+    /* These move the group descriptors and backups, or change what a bitmap bit covers */
+    if (incompat & INCOMPAT_META_BG) {
+        return "The meta_bg feature is not supported";
+    }
+    if (ro_compat & RO_COMPAT_BIGALLOC) {
+        return "The bigalloc feature is not supported";
+    }
+    if (compat & COMPAT_SPARSE_SUPER2) {
+        return "The sparse_super2 feature is not supported";
+    }
+
+    uint32_t log_block_size = get32(raw, 0x18);
+    if (log_block_size > 6) {
+        return "Invalid block size";
+    }
+    sb->block_size = 1024 << log_block_size;
+
+    sb->is_64bit = (incompat & INCOMPAT_64BIT) != 0;
+    sb->sparse_super = (ro_compat & RO_COMPAT_SPARSE_SUPER) != 0;
+    sb->group_csum = (ro_compat & (RO_COMPAT_GDT_CSUM | RO_COMPAT_METADATA_CSUM)) != 0;
+
+    sb->blocks_count = get32(raw, 0x04);
+    if (sb->is_64bit) {
+        sb->blocks_count |= (uint64_t) get32(raw, 0x150) << 32;
+    }
+    sb->first_data_block = get32(raw, 0x14);
+    sb->blocks_per_group = get32(raw, 0x20);
+    sb->desc_size = sb->is_64bit ? get16(raw, 0xfe) : 32;
+    sb->reserved_gdt_blocks = (compat & COMPAT_RESIZE_INODE) ? get16(raw, 0xce) : 0;
+
+    /* Revision 0 filesystems have fixed 128 byte inodes */
+    uint32_t inodes_per_group = get32(raw, 0x28);
+    uint32_t inode_size = get32(raw, 0x4c) == 0 ? 128 : get16(raw, 0x58);
+    sb->inode_table_blocks = ((uint64_t) inodes_per_group * inode_size + sb->block_size - 1) / sb->block_size;
+
+    if (sb->blocks_per_group == 0 || sb->blocks_per_group % 8 != 0 || sb->blocks_per_group > 8 * sb->block_size) {
+        return "Invalid blocks per group";
+    }
+    if (sb->desc_size < 32 || (sb->is_64bit && sb->desc_size < 64) || sb->desc_size > sb->block_size) {
+        return "Invalid group descriptor size";
+    }
+    if (sb->blocks_count <= sb->first_data_block) {
+        return "Invalid block count";
+    }
+    if (sb->blocks_count > length / sb->block_size) {
+        return "Filesystem is larger than the range";
+    }
+
+    sb->groups = (sb->blocks_count - sb->first_data_block + sb->blocks_per_group - 1) / sb->blocks_per_group;
+    sb->gdt_blocks = (sb->groups * sb->desc_size + sb->block_size - 1) / sb->block_size;
+
+    return NULL;
+}
+
+static bool has_backup(const struct superblock *sb, uint64_t group) {
+    if (group <= 1 || !sb->sparse_super) {
+        return true;
+    }
+
+    /* Groups that are powers of 3, 5 and 7 */
+    for (uint64_t base = 3; base <= 7; base += 2) {
+        uint64_t power = base;
+        while (power < group) {
+            power *= base;
+        }
+        if (power == group) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* The map has a bit for each block from first_data_block, as the bitmaps do */
+static void mark(const struct superblock *sb, uint8_t *map, uint64_t block, uint64_t count) {
+    for (uint64_t i = block; i < block + count && i < sb->blocks_count; i++) {
+        if (i >= sb->first_data_block) {
+            uint64_t bit = i - sb->first_data_block;
+            map[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+}
+
+static const char *parse_groups(const struct superblock *sb, const uint8_t *gdt, struct group *groups) {
+    for (uint64_t i = 0; i < sb->groups; i++) {
+        const uint8_t *desc = gdt + i * sb->desc_size;
+        struct group *group = &groups[i];
+
+        group->block_bitmap = get32(desc, 0x00);
+        group->inode_bitmap = get32(desc, 0x04);
+        group->inode_table = get32(desc, 0x08);
+        group->flags = get16(desc, 0x12);
+        if (!sb->group_csum) {
+            /* Like the kernel, only trust the uninitialized flags of checksummed descriptors */
+            group->flags &= ~BG_BLOCK_UNINIT;
+        }
+        if (sb->is_64bit) {
+            group->block_bitmap |= (uint64_t) get32(desc, 0x20) << 32;
+            group->inode_bitmap |= (uint64_t) get32(desc, 0x24) << 32;
+            group->inode_table |= (uint64_t) get32(desc, 0x28) << 32;
+        }
+
+        if (group->block_bitmap >= sb->blocks_count || group->inode_bitmap >= sb->blocks_count || group->inode_table >= sb->blocks_count) {
+            return "Corrupt group descriptor";
+        }
+    }
+
+    return NULL;
+}
+
+static int read_bitmaps(const struct superblock *sb, const struct group *groups, mtk_device *device, uint64_t address, uint8_t *map) {
+    uint8_t *buffer;
+    if ((buffer = malloc((size_t) MAX_BITMAP_READ * sb->block_size)) == NULL) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+
+    int err = 0;
+
+    uint64_t first = 0;
+    while (err == 0 && first < sb->groups) {
+        /* Uninitialized groups only hold metadata, which is marked separately */
+        if (groups[first].flags & BG_BLOCK_UNINIT) {
+            first++;
+            continue;
+        }
+
+        uint64_t count = 1;
+        while (count < MAX_BITMAP_READ && first + count < sb->groups
+                && !(groups[first + count].flags & BG_BLOCK_UNINIT)
+                && groups[first + count].block_bitmap == groups[first].block_bitmap + count) {
+            count++;
+        }
+
+        if ((err = read_memory(device, address + groups[first].block_bitmap * sb->block_size, count * sb->block_size, buffer)) < 0) {
+            break;
+        }
+
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t group = first + i;
+            uint64_t blocks = sb->blocks_count - sb->first_data_block - group * sb->blocks_per_group;
+            if (blocks > sb->blocks_per_group) {
+                blocks = sb->blocks_per_group;
+            }
+
+            /* Groups start on a byte boundary of the map, the last may end within a byte */
+            uint8_t *dest = map + group * sb->blocks_per_group / 8;
+            memcpy(dest, buffer + i * sb->block_size, blocks / 8);
+            if (blocks % 8 != 0) {
+                dest[blocks / 8] = buffer[i * sb->block_size + blocks / 8] & ((1 << (blocks % 8)) - 1);
+            }
+        }
+
+        first += count;
+    }
+
+    free(buffer);
+
+    return err;
+}
+
+static int add_range(struct ext4_ranges *er, size_t *capacity, uint64_t offset, uint64_t length) {
+    if (er->count > 0) {
+        struct ext4_range *last = &er->ranges[er->count - 1];
+        if (offset - (last->offset + last->length) < EXT4_MIN_GAP) {
+            last->length = offset + length - last->offset;
+            return 0;
+        }
+    }
+
+    if (er->count == *capacity) {
+        size_t new_capacity = *capacity != 0 ? *capacity * 2 : 16;
+
+        struct ext4_range *ranges;
+        if ((ranges = realloc(er->ranges, new_capacity * sizeof(*ranges))) == NULL) {
+            return LIBUSB_ERROR_NO_MEM;
+        }
+
+        er->ranges = ranges;
+        *capacity = new_capacity;
+    }
+
+    er->ranges[er->count].offset = offset;
+    er->ranges[er->count].length = length;
+    er->count++;
+
+    return 0;
+}
+
+static int build_ranges(struct ext4_ranges *er, const struct superblock *sb, const uint8_t *map, uint64_t length) {
+    size_t capacity = 0;
+    int err;
+
+    /* Blocks before the first group, e.g. the boot block with 1 KiB blocks */
+    uint64_t run_start = 0;
+    bool in_run = true;
+
+    for (uint64_t block = sb->first_data_block; block < sb->blocks_count; block++) {
+        uint64_t bit = block - sb->first_data_block;
+        bool allocated = (map[bit / 8] >> (bit % 8)) & 1;
+
+        if (allocated && !in_run) {
+            run_start = block;
+            in_run = true;
+        } else if (!allocated && in_run) {
+            if (block > run_start && (err = add_range(er, &capacity, run_start * sb->block_size, (block - run_start) * sb->block_size)) < 0) {
+                return err;
+            }
+            in_run = false;
+        }
+    }
+
+    uint64_t end = sb->blocks_count * sb->block_size;
+    if (in_run && (err = add_range(er, &capacity, run_start * sb->block_size, end - run_start * sb->block_size)) < 0) {
+        return err;
+    }
+
+    /* Partitions may keep data after the filesystem, e.g. an encryption footer */
+    if (length > end && (err = add_range(er, &capacity, end, length - end)) < 0) {
+        return err;
+    }
+
+    for (size_t i = 0; i < er->count; i++) {
+        er->allocated += er->ranges[i].length;
+    }
+
+    return 0;
+}
+
+int ext4_find_allocated(struct ext4_ranges *er, mtk_device *device, uint64_t address, uint64_t length) {
+    er->ranges = NULL;
+    er->count = 0;
+    er->allocated = 0;
+    er->unsupported = NULL;
+
+    if (length < SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE) {
+        er->unsupported = "Range is too short for a filesystem";
+        return 0;
+    }
+
+    int err;
+
+    uint8_t raw[SUPERBLOCK_SIZE];
+    if ((err = read_memory(device, address + SUPERBLOCK_OFFSET, sizeof(raw), raw)) < 0) {
+        return err;
+    }
+
+    struct superblock sb;
+    if ((er->unsupported = parse_superblock(&sb, raw, length)) != NULL) {
+        return 0;
+    }
+
+    uint8_t *gdt = NULL;
+    struct group *groups = NULL;
+    uint8_t *map = NULL;
+
+    if ((gdt = malloc(sb.gdt_blocks * sb.block_size)) == NULL
+            || (groups = calloc(sb.groups, sizeof(*groups))) == NULL
+            || (map = calloc((sb.blocks_count - sb.first_data_block + 7) / 8, 1)) == NULL) {
+        err = LIBUSB_ERROR_NO_MEM;
+        goto out;
+    }
+
+    /* The descriptors follow the superblock, in the block after it */
+    if ((err = read_memory(device, address + (sb.first_data_block + 1) * sb.block_size, sb.gdt_blocks * sb.block_size, gdt)) < 0) {
+        goto out;
+    }
+    if ((er->unsupported = parse_groups(&sb, gdt, groups)) != NULL) {
+        goto out;
+    }
+
+    if ((err = read_bitmaps(&sb, groups, device, address, map)) < 0) {
+        goto out;
+    }
+
+    /* Bitmaps of uninitialized groups are not written, but their metadata is still in use */
+    for (uint64_t i = 0; i < sb.groups; i++) {
+        if (has_backup(&sb, i)) {
+            mark(&sb, map, sb.first_data_block + i * sb.blocks_per_group, 1 + sb.gdt_blocks + sb.reserved_gdt_blocks);
+        }
+        mark(&sb, map, groups[i].block_bitmap, 1);
+        mark(&sb, map, groups[i].inode_bitmap, 1);
+        mark(&sb, map, groups[i].inode_table, sb.inode_table_blocks);
+    }
+
+    err = build_ranges(er, &sb, map, length);
+
+out:
+    free(map);
+    free(groups);
+    free(gdt);
+
+    if (err < 0 || er->unsupported != NULL) {
+        ext4_ranges_free(er);
+    }
+
+    return err;
+}
+
+void ext4_ranges_free(struct ext4_ranges *er) {
+    free(er->ranges);
+    er->ranges = NULL;
+    er->count = 0;
+    er->allocated = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef EXT4_H
+#define EXT4_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+/* Gaps shorter than this are read anyway, a separate read command costs more */
+#define EXT4_MIN_GAP (0x100000)
+
+struct ext4_range {
+    /* Relative to the start of the filesystem */
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct ext4_ranges {
+    struct ext4_range *ranges;
+    size_t count;
+    /* Sum of the range lengths */
+    uint64_t allocated;
+
+    /* Why the filesystem cannot be used, or NULL */
+    const char *unsupported;
+};
+
+/*
+ * Reads the superblock, group descriptors and block bitmaps of the ext4
+ * filesystem at address through the DA, and lists the ranges that hold
+ * metadata or allocated blocks. Anything between the end of the filesystem
+ * and the end of the range is included.
+ */
+int ext4_find_allocated(struct ext4_ranges *er, mtk_device *device, uint64_t address, uint64_t length);
+void ext4_ranges_free(struct ext4_ranges *er);
+
+#endif /* EXT4_H */
@@ -0,0 +1,338 @@
+#include "hasher.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_FILLING,
+    SLOT_QUEUED,
+    SLOT_HASHING,
+};
+
+struct slot {
+    enum slot_state state;
+    uint64_t index;
+    size_t count;
+    uint8_t *data;
+};
+
+struct hasher {
+    uint64_t length;
+    uint64_t chunks;
+    uint8_t (*digests)[HASHER_DIGEST_SIZE];
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t freed;
+    bool done;
+
+    pthread_t threads[HASHER_MAX_THREADS];
+    size_t threads_count;
+
+    /* Twice as many slots as threads, so the stream can fill one while the others are hashed */
+    struct slot slots[2 * HASHER_MAX_THREADS];
+    size_t slots_count;
+
+    /* Slot being filled from the stream, and the next chunk index */
+    struct slot *current;
+    uint64_t next_index;
+};
+
+static void *worker(void *arg);
+static void node_digest(uint8_t prefix, const uint8_t *data, size_t count, const uint8_t *data2, size_t count2, uint8_t *digest);
+static int merkle_root(uint8_t (*digests)[HASHER_DIGEST_SIZE], uint64_t count, uint8_t *root);
+static void print_digest(FILE *fp, const uint8_t *digest);
+
+int hasher_init(struct hasher **hasher, uint64_t length) {
+    struct hasher *ptr;
+    if ((ptr = calloc(1, sizeof(*ptr))) == NULL) {
+        return -errno;
+    }
+
+    ptr->length = length;
+    ptr->chunks = (length + HASHER_CHUNK_SIZE - 1) / HASHER_CHUNK_SIZE;
+
+    if ((ptr->digests = calloc(ptr->chunks ? ptr->chunks : 1, HASHER_DIGEST_SIZE)) == NULL) {
+        free(ptr);
+        return -errno;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus < 1 ? 1 : (cpus > HASHER_MAX_THREADS ? HASHER_MAX_THREADS : (size_t) cpus);
+
+    ptr->slots_count = 2 * threads;
+    for (size_t i = 0; i < ptr->slots_count; i++) {
+        if ((ptr->slots[i].data = malloc(HASHER_CHUNK_SIZE)) == NULL) {
+            int err = -errno;
+            while (i-- > 0) {
+                free(ptr->slots[i].data);
+            }
+            free(ptr->digests);
+            free(ptr);
+            return err;
+        }
+    }
+
+    pthread_mutex_init(&ptr->lock, NULL);
+    pthread_cond_init(&ptr->queued, NULL);
+    pthread_cond_init(&ptr->freed, NULL);
+
+    for (ptr->threads_count = 0; ptr->threads_count < threads; ptr->threads_count++) {
+        if (pthread_create(&ptr->threads[ptr->threads_count], NULL, worker, ptr) != 0) {
+            break;
+        }
+    }
+    if (ptr->threads_count == 0) {
+        hasher_finish(ptr, NULL);
+        return -EAGAIN;
+    }
+
+    *hasher = ptr;
+
+    return 0;
+}
+
+int hasher_update(struct hasher *hasher, const uint8_t *data, size_t count) {
+    while (count > 0) {
+        if (hasher->current == NULL) {
+            pthread_mutex_lock(&hasher->lock);
+
+            while (hasher->current == NULL) {
+                for (size_t i = 0; i < hasher->slots_count; i++) {
+                    if (hasher->slots[i].state == SLOT_FREE) {
+                        hasher->current = &hasher->slots[i];
+                        break;
+                    }
+                }
+                if (hasher->current == NULL) {
+                    /* All slots are queued or being hashed, the workers are slower than the link */
+                    pthread_cond_wait(&hasher->freed, &hasher->lock);
+                }
+            }
+
+            hasher->current->state = SLOT_FILLING;
+            hasher->current->index = hasher->next_index++;
+            hasher->current->count = 0;
+
+            pthread_mutex_unlock(&hasher->lock);
+        }
+
+        struct slot *slot = hasher->current;
+
+        if (slot->index >= hasher->chunks) {
+            return -EFBIG;
+        }
+
+        uint64_t chunk_length = hasher->length - slot->index * HASHER_CHUNK_SIZE;
+        size_t chunk_size = chunk_length < HASHER_CHUNK_SIZE ? chunk_length : HASHER_CHUNK_SIZE;
+
+        size_t n = chunk_size - slot->count;
+        if (n > count) {
+            n = count;
+        }
+
+        memcpy(slot->data + slot->count, data, n);
+        slot->count += n;
+        data += n;
+        count -= n;
+
+        if (slot->count == chunk_size) {
+            pthread_mutex_lock(&hasher->lock);
+            slot->state = SLOT_QUEUED;
+            hasher->current = NULL;
+            pthread_cond_signal(&hasher->queued);
+            pthread_mutex_unlock(&hasher->lock);
+        }
+    }
+
+    return 0;
+}
+
+int hasher_update_file(struct hasher *hasher, int fd, uint64_t length) {
+    uint8_t *buffer;
+    if ((buffer = malloc(HASHER_CHUNK_SIZE)) == NULL) {
+        return -errno;
+    }
+
+    int err = 0;
+
+    uint64_t offset = 0;
+    while (err == 0 && offset < length) {
+        size_t count = length - offset < HASHER_CHUNK_SIZE ? length - offset : HASHER_CHUNK_SIZE;
+
+        ssize_t n;
+        if ((n = pread(fd, buffer, count, offset)) < 0) {
+            err = -errno;
+        } else if ((size_t) n != count) {
+            err = -EIO;
+        } else {
+            err = hasher_update(hasher, buffer, count);
+            offset += count;
+        }
+    }
+
+    free(buffer);
+
+    return err;
+}
+
+int hasher_finish(struct hasher *hasher, const char *manifest_path) {
+    int err = 0;
+
+    pthread_mutex_lock(&hasher->lock);
+    hasher->done = true;
+    pthread_cond_broadcast(&hasher->queued);
+    pthread_mutex_unlock(&hasher->lock);
+
+    for (size_t i = 0; i < hasher->threads_count; i++) {
+        pthread_join(hasher->threads[i], NULL);
+    }
+
+    if (manifest_path != NULL) {
+        if (hasher->current != NULL || hasher->next_index != hasher->chunks) {
+            /* Stream ended early, the manifest would not describe the output */
+            err = -EIO;
+        } else {
+            uint8_t root[HASHER_DIGEST_SIZE];
+
+            FILE *fp;
+            if ((err = merkle_root(hasher->digests, hasher->chunks, root)) < 0) {
+                /* Reported below */
+            } else if ((fp = fopen(manifest_path, "w")) == NULL) {
+                err = -errno;
+            } else {
+                fprintf(fp, "length %" PRIu64 "\n", hasher->length);
+                fprintf(fp, "chunk_size %d\n", HASHER_CHUNK_SIZE);
+                fprintf(fp, "root ");
+                print_digest(fp, root);
+                for (uint64_t i = 0; i < hasher->chunks; i++) {
+                    fprintf(fp, "chunk %" PRIu64 " ", i);
+                    print_digest(fp, hasher->digests[i]);
+                }
+
+                if (fclose(fp) != 0) {
+                    err = -errno;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < hasher->slots_count; i++) {
+        free(hasher->slots[i].data);
+    }
+    pthread_cond_destroy(&hasher->freed);
+    pthread_cond_destroy(&hasher->queued);
+    pthread_mutex_destroy(&hasher->lock);
+    free(hasher->digests);
+    free(hasher);
+
+    return err;
+}
+
+int hash_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) flashing;
+    (void) offset;
+    (void) total_length;
+
+    return hasher_update(user_data, buffer, count);
+}
+
+static void *worker(void *arg) {
+    struct hasher *hasher = arg;
+
+    pthread_mutex_lock(&hasher->lock);
+
+    while (true) {
+        struct slot *slot = NULL;
+        for (size_t i = 0; i < hasher->slots_count; i++) {
+            if (hasher->slots[i].state == SLOT_QUEUED) {
+                slot = &hasher->slots[i];
+                break;
+            }
+        }
+
+        if (slot == NULL) {
+            if (hasher->done) {
+                break;
+            }
+            pthread_cond_wait(&hasher->queued, &hasher->lock);
+            continue;
+        }
+
+        slot->state = SLOT_HASHING;
+        pthread_mutex_unlock(&hasher->lock);
+
+        /* Each chunk has its own digest, so workers never contend on the output */
+        node_digest(0x00, slot->data, slot->count, NULL, 0, hasher->digests[slot->index]);
+
+        pthread_mutex_lock(&hasher->lock);
+        slot->state = SLOT_FREE;
+        pthread_cond_signal(&hasher->freed);
+    }
+
+    pthread_mutex_unlock(&hasher->lock);
+
+    return NULL;
+}
+
+static void node_digest(uint8_t prefix, const uint8_t *data, size_t count, const uint8_t *data2, size_t count2, uint8_t *digest) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    EVP_DigestUpdate(ctx, &prefix, sizeof(prefix));
+    EVP_DigestUpdate(ctx, data, count);
+    if (data2 != NULL) {
+        EVP_DigestUpdate(ctx, data2, count2);
+    }
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+
+    EVP_MD_CTX_free(ctx);
+}
+
+static int merkle_root(uint8_t (*digests)[HASHER_DIGEST_SIZE], uint64_t count, uint8_t *root) {
+    if (count == 0) {
+        SHA256(NULL, 0, root);
+        return 0;
+    }
+
+    /* Reduce a copy of the leaves level by level, in place */
+    uint8_t (*level)[HASHER_DIGEST_SIZE];
+    if ((level = malloc(count * HASHER_DIGEST_SIZE)) == NULL) {
+        return -errno;
+    }
+    memcpy(level, digests, count * HASHER_DIGEST_SIZE);
+
+    while (count > 1) {
+        uint64_t next = 0;
+        for (uint64_t i = 0; i < count; i += 2) {
+            if (i + 1 == count) {
+                memmove(level[next++], level[i], HASHER_DIGEST_SIZE);
+            } else {
+                node_digest(0x01, level[i], HASHER_DIGEST_SIZE, level[i + 1], HASHER_DIGEST_SIZE, level[next++]);
+            }
+        }
+        count = next;
+    }
+
+    memcpy(root, level[0], HASHER_DIGEST_SIZE);
+    free(level);
+
+    return 0;
+}
+
+static void print_digest(FILE *fp, const uint8_t *digest) {
+    for (size_t i = 0; i < HASHER_DIGEST_SIZE; i++) {
+        fprintf(fp, "%02x", digest[i]);
+    }
+    fprintf(fp, "\n");
+}
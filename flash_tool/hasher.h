@@ -0,0 +1,30 @@
+#ifndef HASHER_H
+#define HASHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+/*
+ * Manifests list the SHA-256 digest of every chunk, and a Merkle root over
+ * them. Leaves are SHA-256(0x00 || chunk), inner nodes are
+ * SHA-256(0x01 || left || right), and an odd node is carried up unchanged.
+ */
+
+#define HASHER_CHUNK_SIZE (0x100000)
+#define HASHER_DIGEST_SIZE (32)
+#define HASHER_MAX_THREADS (8)
+
+struct hasher;
+
+int hasher_init(struct hasher **hasher, uint64_t length);
+int hasher_update(struct hasher *hasher, const uint8_t *data, size_t count);
+int hasher_update_file(struct hasher *hasher, int fd, uint64_t length);
+int hasher_finish(struct hasher *hasher, const char *manifest_path);
+
+/* Pipeline stage hashing every chunk, user_data is the hasher */
+int hash_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* HASHER_H */
@@ -0,0 +1,49 @@
+#include "image.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+static void add_part(struct image_header *header, uint32_t part, uint64_t length, uint64_t *offset);
+
+void image_init(struct image_header *header, const mtk_da_emmc_info *emmc) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, IMAGE_MAGIC, sizeof(header->magic));
+    header->version = IMAGE_VERSION;
+    memcpy(header->cid, emmc->cid, sizeof(header->cid));
+
+    uint64_t offset = IMAGE_ALIGN;
+
+    add_part(header, MTK_DA_EMMC_PART_BOOT1, emmc->boot1_size, &offset);
+    add_part(header, MTK_DA_EMMC_PART_BOOT2, emmc->boot2_size, &offset);
+    add_part(header, MTK_DA_EMMC_PART_USER, emmc->ua_size, &offset);
+}
+
+int image_write_header(int fd, const struct image_header *header) {
+    uint8_t buffer[IMAGE_ALIGN] = { 0 };
+    memcpy(buffer, header, sizeof(*header));
+
+    ssize_t n;
+    if ((n = pwrite(fd, buffer, sizeof(buffer), 0)) < 0) {
+        return -errno;
+    }
+    if ((size_t) n != sizeof(buffer)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static void add_part(struct image_header *header, uint32_t part, uint64_t length, uint64_t *offset) {
+    /* Devices without boot partitions report them as empty */
+    if (length == 0) {
+        return;
+    }
+
+    struct image_entry *entry = &header->entries[header->count++];
+    entry->part = part;
+    entry->offset = *offset;
+    entry->length = length;
+
+    *offset += (length + IMAGE_ALIGN - 1) & ~((uint64_t) IMAGE_ALIGN - 1);
+}
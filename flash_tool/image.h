@@ -0,0 +1,39 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdint.h>
+
+#include "mtk_da.h"
+
+/*
+ * Device images start with an image_header, padded to IMAGE_ALIGN, followed
+ * by the data of each indexed partition, each starting at an IMAGE_ALIGN
+ * boundary. All fields are in host byte order.
+ */
+
+#define IMAGE_MAGIC "MTKIMG\r\n"
+#define IMAGE_VERSION (1)
+
+#define IMAGE_ALIGN (0x1000)
+#define IMAGE_MAX_PARTS (8)
+
+struct image_entry {
+    /* MTK_DA_EMMC_PART_* */
+    uint32_t part;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t length;
+} __attribute__((packed));
+
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t cid[4];
+    struct image_entry entries[IMAGE_MAX_PARTS];
+} __attribute__((packed));
+
+void image_init(struct image_header *header, const mtk_da_emmc_info *emmc);
+int image_write_header(int fd, const struct image_header *header);
+
+#endif /* IMAGE_H */
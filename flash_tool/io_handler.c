@@ -2,81 +2,131 @@
 
 #include <err.h>
 #include <errno.h>
-#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
-#define PROGRESS_BAR_WIDTH (48)
-#define SI_UNITS_BUFSIZ (16)
+#ifdef HAVE_LIBURING
+#include "uring_file.h"
+#endif
 
-static void print_progress(bool flashing, size_t offset, size_t length);
-static void format_si_units(size_t length, char *str, size_t size);
+void io_handler_init(struct file_info *fi, int fd) {
+    fi->fd = fd;
+    fi->offset = 0;
+    fi->stream = (lseek(fd, 0, SEEK_CUR) < 0 && errno == ESPIPE);
+    fi->position = 0;
+    fi->uring = NULL;
+    fi->error = 0;
 
-int io_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
-    const struct file_info *fi = user_data;
+    if (fi->stream) {
+        return;
+    }
+
+#ifdef HAVE_LIBURING
+    int err;
+    if ((err = uring_file_init(&fi->uring, fd)) < 0) {
+        /* io_uring may be unavailable or disabled, fall back to blocking I/O */
+        warnx("Unable to set up io_uring, using blocking I/O: %s", strerror(-err));
+        fi->uring = NULL;
+    }
+#endif
+}
 
-    if (lseek(fi->fd, fi->offset + offset, SEEK_SET) < 0) {
-        errx(1, "Unable to seek file descriptor: %s", strerror(errno));
+int io_handler_finish(struct file_info *fi) {
+#ifdef HAVE_LIBURING
+    if (fi->uring != NULL) {
+        int err = uring_file_finish(fi->uring);
+        fi->uring = NULL;
+        return err;
     }
+#else
+    (void) fi;
+#endif
+
+    return 0;
+}
+
+int io_handler_sync(struct file_info *fi) {
+#ifdef HAVE_LIBURING
+    if (fi->uring != NULL) {
+        int err;
+        if ((err = uring_file_sync(fi->uring)) < 0) {
+            return err;
+        }
+    }
+#endif
+
+    /* Not every file supports syncing, e.g. pipes and character devices */
+    if (fdatasync(fi->fd) < 0 && errno != EINVAL) {
+        return -errno;
+    }
+
+    return 0;
+}
 
-    if (flashing) {
+/* Pipes may transfer less than requested, keep going until the whole chunk is done */
+static int transfer_all(int fd, bool flashing, uint8_t *buffer, size_t count, off_t offset) {
+    size_t done = 0;
+    while (done < count) {
         ssize_t n;
-        if ((n = read(fi->fd, buffer, count)) < 0) {
-            errx(1, "Unable to read from file descriptor: %s", strerror(errno));
+        if (offset < 0) {
+            n = flashing ? read(fd, buffer + done, count - done) : write(fd, buffer + done, count - done);
+        } else {
+            n = flashing ? pread(fd, buffer + done, count - done, offset + done) : pwrite(fd, buffer + done, count - done, offset + done);
         }
-        if ((size_t) n != count) {
-            errx(1, "Not enough data read from file descriptor");
+        if (n < 0 && errno == EINTR) {
+            continue;
         }
-    } else {
-        ssize_t n;
-        if ((n = write(fi->fd, buffer, count)) < 0) {
-            errx(1, "Unable to write to file descriptor: %s", strerror(errno));
+        if (n < 0) {
+            return -errno;
         }
-        if ((size_t) n != count) {
-            errx(1, "Not enough data written to file descriptor");
+        if (n == 0) {
+            /* Input ended before the data did */
+            return -EIO;
         }
+
+        done += n;
     }
 
-    print_progress(flashing, offset + count, total_length);
     return 0;
 }
 
-static void print_progress(bool flashing, size_t offset, size_t length) {
-    if (!isatty(STDERR_FILENO)) {
-        return;
-    }
-
-    double progress = (double) offset / length;
-
-    char progress_bar[PROGRESS_BAR_WIDTH + 1];
+static int handle(struct file_info *fi, bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count) {
+    int err;
 
-    size_t progress_bar_fill = progress * PROGRESS_BAR_WIDTH;
-    memset(progress_bar, '#', progress_bar_fill);
-    memset(progress_bar + progress_bar_fill, '-', PROGRESS_BAR_WIDTH - progress_bar_fill);
-    progress_bar[PROGRESS_BAR_WIDTH] = '\0';
+    if (fi->stream) {
+        if (fi->offset + offset != fi->position) {
+            /* Streams can only be read or written in order */
+            return -ESPIPE;
+        }
+        if ((err = transfer_all(fi->fd, flashing, buffer, count, -1)) < 0) {
+            return err;
+        }
 
-    const char *verb = flashing ? "Flashing" : "Dumping";
-    int percent = progress * 100;
+        fi->position += count;
+        return 0;
+    }
 
-    char offset_str[SI_UNITS_BUFSIZ];
-    format_si_units(offset, offset_str, sizeof(offset_str));
-    char length_str[SI_UNITS_BUFSIZ];
-    format_si_units(length, length_str, sizeof(length_str));
+#ifdef HAVE_LIBURING
+    if (fi->uring != NULL) {
+        if (flashing) {
+            return uring_file_read(fi->uring, fi->offset + offset, fi->offset + total_length, buffer, count);
+        }
+        return uring_file_write(fi->uring, fi->offset + offset, buffer, count);
+    }
+#else
+    (void) total_length;
+#endif
 
-    fprintf(stderr, "%s %-8s of %-8s  [%s]  %3d%%%c", verb, offset_str, length_str, progress_bar, percent, (offset == length) ? '\n' : '\r');
-    fflush(stderr);
+    return transfer_all(fi->fd, flashing, buffer, count, fi->offset + offset);
 }
 
-static void format_si_units(size_t length, char *str, size_t size) {
-    static const char *suffix = "BKMG";
-
-    double dbl = length;
-    const char *ptr = suffix;
+int io_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    struct file_info *fi = user_data;
 
-    while (dbl > 1024 && *(ptr + 1) != '\0') {
-        dbl /= 1024;
-        ptr++;
+    int err = handle(fi, flashing, offset, total_length, buffer, count);
+    if (err < 0 && fi->error == 0) {
+        fi->error = err;
     }
 
-    snprintf(str, size, "%.5g %c", dbl, *ptr);
+    return err;
 }
@@ -5,11 +5,28 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct uring_file;
+
 struct file_info {
     int fd;
     size_t offset;
+
+    /* Pipes and other non-seekable files are read and written in order */
+    bool stream;
+    size_t position;
+
+    /* Asynchronous backend, or NULL for blocking I/O */
+    struct uring_file *uring;
+
+    /* First error returned by io_handler, a failed transfer only reports that its handler failed */
+    int error;
 };
 
+void io_handler_init(struct file_info *fi, int fd);
+int io_handler_finish(struct file_info *fi);
+int io_handler_sync(struct file_info *fi);
+
+/* Returns a negative errno, -EIO if a file ends before the data does */
 int io_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
 
 #endif /* IO_HANDLER_H */
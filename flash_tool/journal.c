@@ -0,0 +1,177 @@
+#include "journal.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mtk_capture.h"
+
+#define JOURNAL_MAGIC "MTKJRNL\n"
+#define JOURNAL_VERSION (1)
+
+struct journal_record {
+    char magic[8];
+    uint32_t version;
+    uint32_t key;
+    uint64_t address;
+    uint64_t length;
+    uint64_t offset;
+    uint64_t hash;
+};
+
+static int hash_prefix(int fd, uint64_t length, uint64_t *hash);
+static int journal_write(struct journal *journal);
+
+int journal_open(struct journal *journal, const char *data_path, int key, uint64_t address, uint64_t length, int data_fd) {
+    journal->key = key;
+    journal->address = address;
+    journal->length = length;
+    journal->offset = 0;
+    journal->hash = MTK_FNV1A64_INIT;
+    journal->synced = 0;
+    journal->pending_end = 0;
+    journal->fi = NULL;
+
+    if ((size_t) snprintf(journal->path, sizeof(journal->path), "%s.journal", data_path) >= sizeof(journal->path)) {
+        return -ENAMETOOLONG;
+    }
+
+    if ((journal->fd = open(journal->path, O_RDWR | O_CREAT, 0644)) < 0) {
+        return -errno;
+    }
+
+    struct journal_record record;
+    if (pread(journal->fd, &record, sizeof(record), 0) != sizeof(record)) {
+        /* New journal, start from the beginning */
+        return 0;
+    }
+
+    if (memcmp(record.magic, JOURNAL_MAGIC, sizeof(record.magic)) != 0 || record.version != JOURNAL_VERSION) {
+        warnx("Ignoring invalid journal: %s", journal->path);
+        return 0;
+    }
+    if (record.key != (uint32_t) key || record.address != address || record.length != length || record.offset > length) {
+        warnx("Ignoring journal for a different operation: %s", journal->path);
+        return 0;
+    }
+
+    /* Only trust the journal if the data it covers is still intact */
+    uint64_t hash;
+    if (hash_prefix(data_fd, record.offset, &hash) < 0 || hash != record.hash) {
+        warnx("Ignoring journal, data does not match: %s", journal->path);
+        return 0;
+    }
+
+    journal->offset = record.offset;
+    journal->hash = record.hash;
+    journal->synced = record.offset;
+
+    return 0;
+}
+
+int journal_finish(struct journal *journal) {
+    int err = 0;
+
+    /* Operation completed, nothing is left to resume */
+    if (unlink(journal->path) < 0) {
+        err = -errno;
+    }
+
+    close(journal->fd);
+
+    return err;
+}
+
+int journal_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    struct journal *journal = user_data;
+
+    int err;
+
+    uint64_t start = journal->fi->offset + offset;
+
+    /* When flashing, the next chunk is only requested once the previous one was acknowledged */
+    if (flashing && start == journal->pending_end && start != journal->offset) {
+        journal->offset = journal->pending_end;
+        journal->hash = journal->pending_hash;
+
+        if (journal->offset - journal->synced >= JOURNAL_INTERVAL && (err = journal_write(journal)) < 0) {
+            return err;
+        }
+    }
+
+    if ((err = io_handler(flashing, offset, total_length, buffer, count, journal->fi)) < 0) {
+        return err;
+    }
+
+    if (flashing) {
+        /* Only hash the chunk once it is acknowledged, which the next request shows */
+        journal->pending_end = start + count;
+        journal->pending_hash = mtk_fnv1a64(journal->hash, buffer, count);
+        return 0;
+    }
+
+    journal->hash = mtk_fnv1a64(journal->hash, buffer, count);
+    journal->offset = start + count;
+
+    if (journal->offset - journal->synced >= JOURNAL_INTERVAL) {
+        /* Dumped data must be on disk before the journal claims it */
+        if ((err = io_handler_sync(journal->fi)) < 0) {
+            return err;
+        }
+        if ((err = journal_write(journal)) < 0) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int hash_prefix(int fd, uint64_t length, uint64_t *hash) {
+    uint8_t buffer[0x10000];
+
+    *hash = MTK_FNV1A64_INIT;
+
+    uint64_t offset = 0;
+    while (offset < length) {
+        size_t count = length - offset < sizeof(buffer) ? length - offset : sizeof(buffer);
+
+        ssize_t n;
+        if ((n = pread(fd, buffer, count, offset)) < 0) {
+            return -errno;
+        }
+        if ((size_t) n != count) {
+            return -EIO;
+        }
+
+        *hash = mtk_fnv1a64(*hash, buffer, count);
+        offset += count;
+    }
+
+    return 0;
+}
+
+static int journal_write(struct journal *journal) {
+    struct journal_record record = {
+        .magic = JOURNAL_MAGIC,
+        .version = JOURNAL_VERSION,
+        .key = journal->key,
+        .address = journal->address,
+        .length = journal->length,
+        .offset = journal->offset,
+        .hash = journal->hash,
+    };
+
+    if (pwrite(journal->fd, &record, sizeof(record), 0) != sizeof(record)) {
+        return -errno;
+    }
+    if (fdatasync(journal->fd) < 0) {
+        return -errno;
+    }
+
+    journal->synced = journal->offset;
+
+    return 0;
+}
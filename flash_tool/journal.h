@@ -0,0 +1,39 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io_handler.h"
+
+/* Bytes acknowledged by the DA between journal updates */
+#define JOURNAL_INTERVAL ((uint64_t) 0x4000000)
+
+struct journal {
+    int fd;
+    char path[PATH_MAX];
+
+    int key;
+    uint64_t address;
+    uint64_t length;
+
+    /* Offset acknowledged by the DA, and hash of the data before it */
+    uint64_t offset;
+    uint64_t hash;
+    uint64_t synced;
+
+    /* Chunk handed out for flashing, which the DA has not acknowledged yet */
+    uint64_t pending_end;
+    uint64_t pending_hash;
+
+    struct file_info *fi;
+};
+
+int journal_open(struct journal *journal, const char *data_path, int key, uint64_t address, uint64_t length, int data_fd);
+int journal_finish(struct journal *journal);
+
+int journal_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* JOURNAL_H */
@@ -1,33 +1,119 @@
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <libusb.h>
 
 #include "args.h"
+#include "block_cache.h"
+#include "encryption.h"
+#include "ext4.h"
+#include "hasher.h"
+#include "image.h"
 #include "io_handler.h"
+#include "journal.h"
+#include "nbd.h"
+#include "progress.h"
+#include "store.h"
 #include "util.h"
+#include "verify.h"
+#include "zero_ranges.h"
 
+#include "mtk_capture.h"
 #include "mtk_da.h"
 #include "mtk_device.h"
+#include "mtk_pipeline.h"
 #include "mtk_preloader.h"
+#include "mtk_replay.h"
+#include "mtk_stats.h"
 
+static void write_stats(void);
+static void finish_capture(void);
+static void print_phase_summary(const mtk_stats *stats);
+static void report_replay(void);
+static void print_attach_elapsed(const char *event);
+
+static bool handle_state_auto(mtk_device *device, const struct arguments *arguments, const mtk_da_info *info);
 static void handle_state_none(mtk_device *device);
-static void handle_state_preloader(mtk_device *device, int download_agent_fd, const mtk_da_info *info);
-static void handle_state_da_stage2(mtk_device *device, const struct operation *operations, size_t count, bool reboot);
+static void handle_state_preloader(mtk_device *device, const mtk_da_info *info, size_t info_size, mtk_da_emmc_info *emmc);
+static bool handle_state_da_stage2(mtk_device *device, struct arguments *arguments, const mtk_da_emmc_info *emmc, struct store *store);
+static void switch_high_speed(mtk_device *device, unsigned int timeout);
+static void measure_link(mtk_device *device);
+static void handle_transfer(mtk_device *device, const struct operation *operation, const struct arguments *arguments);
+static void flash_erasing_zeros(mtk_device *device, const struct operation *operation, struct file_info *fi, uint64_t erase_group);
+static bool dump_allocated(mtk_device *device, const struct operation *operation);
+static bool erase_range(mtk_device *device, uint64_t address, uint64_t length);
+static void handle_image(mtk_device *device, const struct operation *operation, const mtk_da_emmc_info *emmc);
+static void handle_backup(mtk_device *device, const struct operation *operation, struct store *store);
+static void handle_nbd(mtk_device *device, const struct operation *operation, const mtk_da_emmc_info *emmc);
+
+/* Session telemetry has static storage, as it is written from an atexit handler */
+static mtk_stats session_stats;
+static mtk_stats *stats = NULL;
+static const char *stats_path = NULL;
+
+static mtk_capture session_capture;
+static mtk_capture *capture = NULL;
+
+static mtk_replay session_replay;
+static mtk_replay *replay = NULL;
+
+/* Read before the operations start, enough to tell a high speed link from a full speed one */
+#define LINK_TEST_LENGTH (0x400000)
+
+/* When the device was attached, attach and sync latency is reported against it */
+static uint64_t attached_ns;
 
 int main(int argc, char **argv) {
     struct arguments arguments;
     args_parse(argc, argv, &arguments);
 
+    if (arguments.stdout_data) {
+        /* Data owns the original standard output, keep messages out of the stream */
+        if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            check_errnum(errno, "Unable to redirect standard output");
+        }
+    }
+
     int err;
 
+    /* The report is also written when the session fails part way through */
+    if (arguments.telemetry != NULL || arguments.replay != NULL) {
+        mtk_stats_init(&session_stats);
+        stats = &session_stats;
+        stats_path = arguments.telemetry;
+        atexit(write_stats);
+    }
+
+    if (arguments.capture != NULL) {
+        int fd;
+        if ((fd = open(arguments.capture, O_WRONLY | O_CREAT | O_TRUNC, DEFFILEMODE)) < 0) {
+            check_errnum(errno, "Unable to open capture file");
+        }
+
+        uint32_t payload_limit = arguments.capture_full ? UINT32_MAX : MTK_CAPTURE_DEFAULT_PAYLOAD_LIMIT;
+        err = mtk_capture_init(&session_capture, fd, payload_limit);
+        check_errnum(-err, "Unable to start capture");
+
+        capture = &session_capture;
+        atexit(finish_capture);
+    }
+
     const mtk_da_info *info = NULL;
+    size_t info_size = 0;
 
-    if (arguments.state != DEVICE_STATE_DA_STAGE2) {
-        err = mtk_da_info_load(arguments.download_agent_fd, &info);
+    if (arguments.download_agent_fd >= 0) {
+        mtk_stats_phase_begin(stats, "load_da");
+
+        err = mtk_da_info_load(arguments.download_agent_fd, &info, &info_size);
         check_errnum(-err, "Unable to load Download Agent binary");
 
         printf("DA identifier:   %.*s\n", (int) sizeof(info->da_identifier), info->da_identifier);
@@ -36,48 +122,184 @@ int main(int argc, char **argv) {
         printf("\n");
     }
 
-    err = libusb_init(NULL);
-    check_libusb(err, "libusb_init failed");
+    mtk_device device;
+
+    if (arguments.replay != NULL) {
+        printf("Replaying captured session...\n");
+        mtk_stats_phase_begin(stats, "detect");
+
+        int fd;
+        if ((fd = open(arguments.replay, O_RDONLY)) < 0) {
+            check_errnum(errno, "Unable to open capture file");
+        }
+
+        err = mtk_replay_init(&session_replay, fd, arguments.replay_original_timing);
+        check_errnum(-err, "Unable to load capture file");
 
-    int level = arguments.verbose ? LIBUSB_LOG_LEVEL_DEBUG : LIBUSB_LOG_LEVEL_INFO;
+        replay = &session_replay;
+        atexit(report_replay);
+
+        mtk_device_open_transport(&device, &mtk_replay_transport, replay);
+    } else {
+        err = libusb_init(NULL);
+        check_libusb(err, "libusb_init failed");
+
+        int level = arguments.verbose ? LIBUSB_LOG_LEVEL_DEBUG : LIBUSB_LOG_LEVEL_INFO;
 #if LIBUSB_API_VERSION >= 0x01000106
-    libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, level);
+        libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, level);
 #else
-    libusb_set_debug(NULL, level);
+        libusb_set_debug(NULL, level);
 #endif
 
-    printf("Waiting for MediaTek device...\n");
+        printf("Waiting for MediaTek device...\n");
+        mtk_stats_phase_begin(stats, "detect");
 
-    mtk_device device;
-    err = mtk_device_detect(&device, NULL);
-    check_libusb(err, "Unable to detect MediaTek device");
+        err = mtk_device_detect(&device, NULL, arguments.wait);
+        check_libusb(err, "Unable to detect MediaTek device");
+    }
+
+    attached_ns = mtk_stats_now();
+
+    device.stats = stats;
+    device.capture = capture;
+
+    bool verified = true;
+    mtk_da_emmc_info emmc;
+
+    struct store session_store;
+    struct store *store = NULL;
+    if (arguments.store != NULL) {
+        err = store_open(&session_store, arguments.store);
+        check_errnum(-err, "Unable to open chunk store");
+        store = &session_store;
+    }
+
+    mtk_progress progress;
+    if (progress_init(&progress, arguments.machine_readable)) {
+        device.progress = &progress;
+    }
 
     switch (arguments.state) {
+        case DEVICE_STATE_AUTO:
+            if (handle_state_auto(&device, &arguments, info)) {
+                verified = handle_state_da_stage2(&device, &arguments, &emmc, store);
+                break;
+            }
+            /* fallthrough */
         case DEVICE_STATE_NONE:
             handle_state_none(&device);
             /* fallthrough */
         case DEVICE_STATE_PRELOADER:
-            handle_state_preloader(&device, arguments.download_agent_fd, info);
+            handle_state_preloader(&device, info, info_size, &emmc);
             /* fallthrough */
         case DEVICE_STATE_DA_STAGE2:
-            handle_state_da_stage2(&device, arguments.operations, arguments.operations_count, arguments.reboot);
+            verified = handle_state_da_stage2(&device, &arguments, &emmc, store);
             break;
     }
 
-    return 0;
+    mtk_stats_phase_end(stats);
+
+    if (store != NULL) {
+        store_close(store);
+    }
+
+    if (replay != NULL) {
+        print_phase_summary(stats);
+    }
+
+    return verified ? 0 : 3;
+}
+
+static void print_phase_summary(const mtk_stats *stats) {
+    printf("%-16s %12s %12s %12s %10s\n", "Phase", "Wall (ms)", "CPU (ms)", "Bytes", "MB/s");
+
+    for (size_t i = 0; i < stats->phases_count; i++) {
+        const mtk_stats_phase *phase = &stats->phases[i];
+        uint64_t bytes = phase->bytes_in + phase->bytes_out;
+        double rate = phase->duration_ns > 0 ? bytes * 1e3 / phase->duration_ns : 0;
+
+        printf("%-16s %12.3f %12.3f %12" PRIu64 " %10.2f\n", phase->name,
+                phase->duration_ns / 1e6, phase->cpu_ns / 1e6, bytes, rate);
+    }
+}
+
+static void print_attach_elapsed(const char *event) {
+    printf("%s %.1f ms after attach\n", event, (mtk_stats_now() - attached_ns) / 1e6);
+}
+
+static void report_replay(void) {
+    if (replay->diverged) {
+        warnx("Session diverged from capture at record %zu", replay->records);
+    }
+    mtk_replay_finish(replay);
+}
+
+static void write_stats(void) {
+    mtk_stats_phase_end(stats);
+
+    if (stats_path == NULL) {
+        return;
+    }
+
+    FILE *fp;
+    if ((fp = fopen(stats_path, "w")) == NULL) {
+        warn("Unable to open telemetry report: %s", stats_path);
+        return;
+    }
+
+    if (mtk_stats_write_json(stats, fp) < 0 || fclose(fp) != 0) {
+        warnx("Unable to write telemetry report: %s", stats_path);
+    }
+}
+
+static void finish_capture(void) {
+    if (mtk_capture_finish(capture) < 0) {
+        warnx("Unable to write capture file");
+    }
+    close(capture->fd);
+}
+
+static bool handle_state_auto(mtk_device *device, const struct arguments *arguments, const mtk_da_info *info) {
+    printf("Probing device state...\n");
+    mtk_stats_phase_begin(device->stats, "probe");
+
+    bool running;
+    int err = mtk_da_probe(device, &running);
+    check_libusb(err, "Unable to probe device state");
+
+    if (!running) {
+        printf("Device is in Preloader mode\n");
+        if (info == NULL) {
+            errx(1, "MediaTek Download Agent binary is mandatory, unless device is in DA Stage 2");
+        }
+        return false;
+    }
+
+    printf("DA Stage 2 is already running, skipping DA upload\n");
+    for (size_t i = 0; i < arguments->operations_count; i++) {
+        if (operation_needs_report(&arguments->operations[i])) {
+            errx(1, "Device images and NBD exports without a length require the DA report, which is only sent with the DA");
+        }
+    }
+
+    return true;
 }
 
 static void handle_state_none(mtk_device *device) {
     printf("Syncing with MediaTek Preloader...\n");
+    mtk_stats_phase_begin(device->stats, "preloader_sync");
 
     int err = mtk_preloader_start(device);
     check_libusb(err, "Unable to sync with MediaTek Preloader");
+
+    print_attach_elapsed("Preloader synced");
 }
 
-static void handle_state_preloader(mtk_device *device, int download_agent_fd, const mtk_da_info *info) {
+static void handle_state_preloader(mtk_device *device, const mtk_da_info *info, size_t info_size, mtk_da_emmc_info *emmc) {
     int err;
     uint16_t status;
-    struct file_info fi;
+
+    mtk_stats_phase_begin(device->stats, "preloader_info");
 
     uint16_t hw_code;
     err = mtk_preloader_get_hw_code(device, &hw_code, &status);
@@ -141,16 +363,21 @@ static void handle_state_preloader(mtk_device *device, int download_agent_fd, co
         errx(1, "DA Stage 2 signature is not at end of load region");
     }
 
+    const uint8_t *da_stage1_data, *da_stage2_data;
+    err = mtk_da_info_region(info, info_size, da_stage1, &da_stage1_data);
+    check_errnum(-err, "DA Stage 1 load region is out of bounds");
+    err = mtk_da_info_region(info, info_size, da_stage2, &da_stage2_data);
+    check_errnum(-err, "DA Stage 2 load region is out of bounds");
+
+    mtk_stats_phase_begin(device->stats, "da_stage1");
+
     printf("\nDisabling watchdog timer...\n");
     err = mtk_preloader_disable_wdt(device, &status);
     check_libusb(err, "Unable to disable WDT");
     check_mtk_preloader(status, "WRITE32");
 
-    fi.fd = download_agent_fd;
-    fi.offset = da_stage1->offset;
-
     printf("Sending DA Stage 1...\n");
-    err = mtk_preloader_send_da(device, da_stage1->start_addr, da_stage1->len, da_stage1->sig_len, &status, io_handler, &fi);
+    err = mtk_preloader_send_da(device, da_stage1->start_addr, da_stage1->len, da_stage1->sig_len, da_stage1_data, &status);
     check_libusb(err, "Unable to send DA");
     check_mtk_preloader(status, "SEND_DA");
 
@@ -175,70 +402,500 @@ static void handle_state_preloader(mtk_device *device, int download_agent_fd, co
             emmc_id[0], emmc_id[1], emmc_id[2], emmc_id[3]);
     printf("DA version:  DA_v%" PRIu8 ".%" PRIu8 "\n", da_major_ver, da_minor_ver);
 
-    fi.fd = download_agent_fd;
-    fi.offset = da_stage2->offset;
+    mtk_stats_phase_begin(device->stats, "da_stage2");
 
     printf("\nSending DA Stage 2...\n");
     uint8_t retval;
-    err = mtk_da_send_da(device, da_stage2->start_addr, da_stage2->len, &retval, io_handler, &fi);
+    err = mtk_da_send_da(device, da_stage2->start_addr, da_stage2->len, da_stage2_data, &retval);
     check_libusb(err, "Unable to send DA");
     check_mtk_da_ack(retval);
 
-    err = mtk_device_read(device, NULL, MTK_DA_FULL_REPORT_SIZE);
+    err = mtk_da_read_report(device, emmc, &retval);
     check_libusb(err, "Unable to read DA report");
-    err = mtk_device_read8(device, &retval);
-    check_libusb(err, "Unable to read DA return value");
     check_mtk_da_soc_ok(retval);
+
+    printf("\nBOOT1 size:  0x%016" PRIx64 "\n", emmc->boot1_size);
+    printf("BOOT2 size:  0x%016" PRIx64 "\n", emmc->boot2_size);
+    printf("RPMB size:   0x%016" PRIx64 "\n", emmc->rpmb_size);
+    printf("USER size:   0x%016" PRIx64 "\n", emmc->ua_size);
 }
 
-static void handle_state_da_stage2(mtk_device *device, const struct operation *operations, size_t count, bool reboot) {
+static bool handle_state_da_stage2(mtk_device *device, struct arguments *arguments, const mtk_da_emmc_info *emmc, struct store *store) {
     int err;
     uint8_t retval;
+    bool verified = true;
+
+    mtk_stats_phase_begin(device->stats, "usb_status");
 
     uint8_t usb_status;
     err = mtk_da_usb_check_status(device, &usb_status, &retval);
     check_libusb(err, "Unable to check USB status");
     check_mtk_da_ack(retval);
-    if (usb_status != 1) {
+    if (usb_status > MTK_DA_USB_HIGH_SPEED) {
         errx(2, "DA did not return valid USB status: %02" PRIx8, usb_status);
     }
 
+    if (usb_status == MTK_DA_USB_FULL_SPEED) {
+        switch_high_speed(device, arguments->wait != 0 ? arguments->wait : MTK_DEVICE_REATTACH_TMOUT);
+    }
+
+    int speed = mtk_device_speed(device);
+    if (speed == LIBUSB_SPEED_LOW || speed == LIBUSB_SPEED_FULL) {
+        warnx("Link is only full speed although the DA is in high speed mode, check the cable and hubs");
+    }
+
+    print_attach_elapsed("Device ready");
+
+    if (arguments->operations_count > 0) {
+        measure_link(device);
+    }
+
     printf("\n");
-    for (size_t i = 0; i < count; i++) {
-        const struct operation *operation = &operations[i];
-        printf("Address:  0x%016" PRIx64 "\n", operation->address);
-        printf("Length:   0x%016" PRIx64 "\n", operation->length);
+    for (size_t i = 0; i < arguments->operations_count; i++) {
+        struct operation *operation = &arguments->operations[i];
+        if (operation->key != 'I' && operation->key != 'N') {
+            printf("Address:  0x%016" PRIx64 "\n", operation->address);
+            printf("Length:   0x%016" PRIx64 "\n", operation->length);
+        }
+        printf("Path:     %s\n", operation->path);
+
+        err = operation_open(operation);
+        check_errnum(-err, "Unable to open file for operation");
 
         err = mtk_da_sdmmc_switch_part(device, MTK_DA_EMMC_PART_USER, &retval);
         check_libusb(err, "Unable to switch partition to EMMC_USER");
         check_mtk_da_ack(retval);
 
-        struct file_info fi = {
-            .fd = operation->fd,
-            .offset = 0,
-        };
+        struct verify_info vi;
 
         switch (operation->key) {
             case 'D':
-                err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, operation->address, operation->length, &retval, io_handler, &fi);
-                check_libusb(err, "Unable to perform dump operation");
-                check_mtk_da_ack(retval);
+            case 'F':
+                if (operation->key == 'D' && arguments->allocated_only && dump_allocated(device, operation)) {
+                    break;
+                }
+                handle_transfer(device, operation, arguments);
                 break;
 
-            case 'F':
-                err = mtk_da_sdmmc_write_data(device, MTK_DA_STORAGE_EMMC, MTK_DA_EMMC_PART_USER, operation->address, operation->length, &retval, io_handler, &fi);
-                check_libusb(err, "Unable to perform flash operation");
-                check_mtk_da_cont_char(retval);
+            case 'B':
+                handle_backup(device, operation, store);
+                break;
+
+            case 'N':
+                handle_nbd(device, operation, emmc);
+                break;
+
+            case 'I':
+                handle_image(device, operation, emmc);
+                break;
+
+            case 'V':
+                mtk_stats_phase_begin(device->stats, "verify");
+
+                err = verify_init(&vi, operation->fd, operation->address, operation->length);
+                check_errnum(-err, "Unable to map file for verification");
+                err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, operation->address, operation->length, &retval, verify_handler, &vi);
+                check_libusb(err, "Unable to perform verify operation");
+                check_mtk_da_ack(retval);
+                verify_finish(&vi);
+
+                if (vi.mismatch_ranges == 0) {
+                    printf("Verified OK\n");
+                } else {
+                    printf("Verification failed: %zu mismatching ranges, 0x%" PRIx64 " bytes\n", vi.mismatch_ranges, vi.mismatch_bytes);
+                    verified = false;
+                }
                 break;
         }
 
+        operation_close(operation);
+
         printf("\n");
     }
 
-    if (reboot) {
+    if (arguments->reboot) {
+        mtk_stats_phase_begin(device->stats, "reboot");
+
         printf("Enabling WDT to reboot device...\n");
         err = mtk_da_enable_watchdog(device, 0, false, false, false, true, &retval);
         check_libusb(err, "Unable to enable WDT");
         check_mtk_da_ack(retval);
     }
+
+    return verified;
+}
+
+static void switch_high_speed(mtk_device *device, unsigned int timeout) {
+    int err;
+    uint8_t retval;
+
+    printf("DA is at full speed, switching to high speed...\n");
+    mtk_stats_phase_begin(device->stats, "usb_switch");
+
+    err = mtk_da_usb_setup_port(device, MTK_DA_USB_HIGH_SPEED, &retval);
+    check_libusb(err, "Unable to switch USB speed");
+    check_mtk_da_ack(retval);
+
+    err = mtk_device_reattach(device, NULL, timeout);
+    check_libusb(err, "Unable to re-attach to device after switching USB speed");
+
+    uint8_t usb_status;
+    err = mtk_da_usb_check_status(device, &usb_status, &retval);
+    check_libusb(err, "Unable to check USB status");
+    check_mtk_da_ack(retval);
+    if (usb_status != MTK_DA_USB_HIGH_SPEED) {
+        errx(2, "DA is still not at high speed after switching: %02" PRIx8, usb_status);
+    }
+}
+
+static int discard_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) flashing;
+    (void) offset;
+    (void) total_length;
+    (void) buffer;
+    (void) count;
+    (void) user_data;
+
+    return 0;
+}
+
+static void measure_link(mtk_device *device) {
+    int err;
+    uint8_t retval;
+
+    mtk_stats_phase_begin(device->stats, "link_test");
+
+    err = mtk_da_sdmmc_switch_part(device, MTK_DA_EMMC_PART_USER, &retval);
+    check_libusb(err, "Unable to switch partition to EMMC_USER");
+    check_mtk_da_ack(retval);
+
+    /* Too short to be worth a progress display */
+    mtk_progress *progress = device->progress;
+    device->progress = NULL;
+
+    uint64_t start = mtk_stats_now();
+    err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, 0, LINK_TEST_LENGTH, &retval, discard_handler, NULL);
+    uint64_t elapsed = mtk_stats_now() - start;
+
+    device->progress = progress;
+
+    check_libusb(err, "Unable to measure link throughput");
+    check_mtk_da_ack(retval);
+
+    printf("Link throughput: %.2f MB/s\n", LINK_TEST_LENGTH * 1e3 / elapsed);
+}
+
+static void handle_transfer(mtk_device *device, const struct operation *operation, const struct arguments *arguments) {
+    int err;
+    uint8_t retval;
+
+    bool flashing = (operation->key == 'F');
+
+    mtk_stats_phase_begin(device->stats, flashing ? "flash" : "dump");
+
+    bool journal = arguments->journal;
+    bool manifest = arguments->manifest;
+
+    struct journal jnl;
+    uint64_t resume = 0;
+
+    if (journal) {
+        err = journal_open(&jnl, operation->path, operation->key, operation->address, operation->length, operation->fd);
+        check_errnum(-err, "Unable to open journal");
+
+        resume = jnl.offset;
+        if (resume != 0) {
+            printf("Resuming from 0x%016" PRIx64 "\n", operation->address + resume);
+        }
+    }
+
+    struct stat st;
+    if (!flashing && fstat(operation->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        /* Discard anything past the data that is known to be good */
+        if (ftruncate(operation->fd, resume) < 0) {
+            check_errnum(errno, "Unable to truncate file");
+        }
+    }
+
+    struct file_info fi;
+    io_handler_init(&fi, operation->fd);
+    fi.offset = resume;
+
+    mtk_io_handler handler = io_handler;
+    void *user_data = &fi;
+    if (journal) {
+        jnl.fi = &fi;
+        handler = journal_handler;
+        user_data = &jnl;
+    }
+
+    struct encryption *encryption = NULL;
+    if (arguments->encrypted) {
+        err = encryption_init(&encryption, &fi, arguments->encryption_key, flashing, operation->length);
+        check_errnum(-err, flashing ? "Unable to read encrypted input" : "Unable to start encryption");
+
+        handler = encryption_handler;
+        user_data = encryption;
+    }
+
+    /* Dumps are written and hashed on their own threads, off the USB transfer, flash input is read inline */
+    mtk_pipeline pipeline;
+    err = mtk_pipeline_init(&pipeline, MTK_PIPELINE_DEFAULT_DEPTH);
+    check_errnum(-err, "Unable to start pipeline");
+
+    err = mtk_pipeline_add_stage(&pipeline, handler, user_data, !flashing);
+    check_errnum(-err, "Unable to start pipeline");
+
+    struct hasher *hasher = NULL;
+    if (manifest && !flashing) {
+        err = hasher_init(&hasher, operation->length);
+        check_errnum(-err, "Unable to start hashing");
+
+        /* A resumed dump only streams the rest, hash what is already on disk */
+        err = hasher_update_file(hasher, operation->fd, resume);
+        check_errnum(-err, "Unable to hash existing data");
+
+        err = mtk_pipeline_add_stage(&pipeline, hash_handler, hasher, true);
+        check_errnum(-err, "Unable to start hashing");
+    }
+
+    uint64_t address = operation->address + resume;
+    uint64_t length = operation->length - resume;
+    bool erasing = flashing && arguments->erase_zeros && !fi.stream;
+
+    err = 0;
+    if (length != 0 && erasing) {
+        flash_erasing_zeros(device, operation, &fi, arguments->erase_group);
+    } else if (length != 0 && flashing) {
+        err = mtk_da_sdmmc_write_data(device, MTK_DA_STORAGE_EMMC, MTK_DA_EMMC_PART_USER, address, length, arguments->erase_group, &retval, mtk_pipeline_handler, &pipeline);
+    } else if (length != 0) {
+        err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, address, length, &retval, mtk_pipeline_handler, &pipeline);
+    }
+
+    /* Threaded stages are stopped first, so nothing else is running once the tool exits */
+    check_transfer(err, mtk_pipeline_finish(&pipeline), flashing ? "Unable to perform flash operation" : "Unable to perform dump operation");
+    if (length != 0 && !erasing) {
+        if (flashing) {
+            check_mtk_da_cont_char(retval);
+        } else {
+            check_mtk_da_ack(retval);
+        }
+    }
+
+    if (encryption != NULL) {
+        err = encryption_finish(encryption);
+        check_errnum(-err, "Unable to complete encryption");
+    }
+
+    err = io_handler_finish(&fi);
+    check_errnum(-err, "Unable to complete file I/O");
+
+    if (hasher != NULL) {
+        char path[PATH_MAX];
+        if ((size_t) snprintf(path, sizeof(path), "%s.manifest", operation->path) >= sizeof(path)) {
+            errx(1, "Manifest path is too long");
+        }
+
+        err = hasher_finish(hasher, path);
+        check_errnum(-err, "Unable to write manifest");
+    }
+
+    if (journal) {
+        err = journal_finish(&jnl);
+        check_errnum(-err, "Unable to remove journal");
+    }
+}
+
+static void flash_erasing_zeros(mtk_device *device, const struct operation *operation, struct file_info *fi, uint64_t erase_group) {
+    int err;
+    uint8_t retval;
+
+    struct zero_ranges zr;
+    err = zero_ranges_find(&zr, operation->fd, operation->address, operation->length, erase_group != 0 ? erase_group : MTK_DA_EMMC_ERASE_GROUP);
+    check_errnum(-err, "Unable to scan file for zero ranges");
+
+    bool erase = true;
+    uint64_t offset = 0;
+
+    for (size_t i = 0; i <= zr.count; i++) {
+        /* Data up to the next zero range, which is included if it could not be erased */
+        uint64_t end = (i < zr.count) ? zr.ranges[i].offset : operation->length;
+        if (end > offset) {
+            fi->offset = offset;
+            err = mtk_da_sdmmc_write_data(device, MTK_DA_STORAGE_EMMC, MTK_DA_EMMC_PART_USER, operation->address + offset, end - offset, erase_group, &retval, io_handler, fi);
+            check_transfer(err, fi->error, "Unable to perform flash operation");
+            check_mtk_da_cont_char(retval);
+
+            offset = end;
+        }
+
+        if (i == zr.count) {
+            break;
+        }
+
+        const struct zero_range *range = &zr.ranges[i];
+        if (erase && (erase = erase_range(device, operation->address + range->offset, range->length))) {
+            offset = range->offset + range->length;
+        }
+    }
+
+    zero_ranges_free(&zr);
+}
+
+static bool erase_range(mtk_device *device, uint64_t address, uint64_t length) {
+    int err;
+    uint8_t retval;
+
+    printf("Erasing 0x%016" PRIx64 " bytes of zeros at 0x%016" PRIx64 "\n", length, address);
+
+    err = mtk_da_format(device, MTK_DA_HW_STORAGE_EMMC, address, length, &retval);
+    check_libusb(err, "Unable to erase range");
+    if (retval != MTK_DA_ACK) {
+        printf("DA is unable to erase, writing zeros instead\n");
+        return false;
+    }
+
+    /* Depending on the EMMC, erased blocks read back as zeros or ones */
+    bool zero = true;
+    err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, address, 512, &retval, zero_check_handler, &zero);
+    check_libusb(err, "Unable to read back erased range");
+    check_mtk_da_ack(retval);
+
+    if (!zero) {
+        printf("Erased blocks do not read back as zeros, writing zeros instead\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool dump_allocated(mtk_device *device, const struct operation *operation) {
+    int err;
+    uint8_t retval;
+
+    mtk_stats_phase_begin(device->stats, "dump");
+
+    struct ext4_ranges er;
+    err = ext4_find_allocated(&er, device, operation->address, operation->length);
+    check_libusb(err, "Unable to read filesystem metadata");
+    if (er.unsupported != NULL) {
+        printf("%s, dumping every block\n", er.unsupported);
+        return false;
+    }
+
+    printf("Filesystem uses 0x%016" PRIx64 " bytes in %zu ranges\n", er.allocated, er.count);
+
+    /* Free blocks are left as holes, and read back as zeros */
+    if (ftruncate(operation->fd, 0) < 0 || ftruncate(operation->fd, operation->length) < 0) {
+        check_errnum(errno, "Unable to create sparse file");
+    }
+
+    struct file_info fi;
+    io_handler_init(&fi, operation->fd);
+
+    for (size_t i = 0; i < er.count; i++) {
+        const struct ext4_range *range = &er.ranges[i];
+
+        fi.offset = range->offset;
+        err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, operation->address + range->offset, range->length, &retval, io_handler, &fi);
+        check_transfer(err, fi.error, "Unable to perform dump operation");
+        check_mtk_da_ack(retval);
+    }
+
+    err = io_handler_finish(&fi);
+    check_errnum(-err, "Unable to complete file I/O");
+    ext4_ranges_free(&er);
+
+    return true;
+}
+
+static void handle_image(mtk_device *device, const struct operation *operation, const mtk_da_emmc_info *emmc) {
+    int err;
+    uint8_t retval;
+
+    mtk_stats_phase_begin(device->stats, "image");
+
+    if (emmc->ret != 0) {
+        errx(2, "DA report contains EMMC error: 0x%" PRIx32, emmc->ret);
+    }
+
+    struct image_header header;
+    image_init(&header, emmc);
+
+    err = image_write_header(operation->fd, &header);
+    check_errnum(-err, "Unable to write image header");
+
+    for (size_t i = 0; i < header.count; i++) {
+        const struct image_entry *entry = &header.entries[i];
+        printf("Imaging partition %" PRIu32 ", 0x%016" PRIx64 " bytes\n", entry->part, entry->length);
+
+        err = mtk_da_sdmmc_switch_part(device, entry->part, &retval);
+        check_libusb(err, "Unable to switch partition");
+        check_mtk_da_ack(retval);
+
+        struct file_info fi;
+        io_handler_init(&fi, operation->fd);
+        fi.offset = entry->offset;
+
+        err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, 0, entry->length, &retval, io_handler, &fi);
+        check_transfer(err, fi.error, "Unable to perform image operation");
+        check_mtk_da_ack(retval);
+
+        err = io_handler_finish(&fi);
+        check_errnum(-err, "Unable to complete file I/O");
+    }
+}
+
+static void handle_backup(mtk_device *device, const struct operation *operation, struct store *store) {
+    int err;
+    uint8_t retval;
+
+    mtk_stats_phase_begin(device->stats, "backup");
+
+    err = store_begin(store, operation->fd, operation->address, operation->length);
+    check_errnum(-err, "Unable to write recipe");
+
+    err = mtk_da_read(device, MTK_DA_HW_STORAGE_EMMC, operation->address, operation->length, &retval, store_handler, store);
+    check_libusb(err, "Unable to perform backup operation");
+    check_mtk_da_ack(retval);
+
+    err = store_finish(store);
+    check_errnum(-err, "Unable to complete backup");
+
+    printf("Stored %" PRIu64 " new chunks of %" PRIu64 " (0x%" PRIx64 " bytes written)\n", store->new_chunks, store->chunks, store->new_bytes);
+}
+
+static void handle_nbd(mtk_device *device, const struct operation *operation, const mtk_da_emmc_info *emmc) {
+    int err;
+
+    mtk_stats_phase_begin(device->stats, "nbd");
+
+    uint64_t length = operation->length;
+    if (length == 0) {
+        if (operation->address >= emmc->ua_size) {
+            errx(1, "Address is past the end of the USER area");
+        }
+        length = emmc->ua_size - operation->address;
+    }
+
+    printf("Address:  0x%016" PRIx64 "\n", operation->address);
+    printf("Length:   0x%016" PRIx64 "\n", length);
+
+    struct block_cache cache;
+    err = block_cache_init(&cache, device, operation->address, length);
+    check_errnum(-err, "Unable to allocate block cache");
+
+    /* Reads are small and frequent, a progress bar for each would only be noise */
+    mtk_progress *progress = device->progress;
+    device->progress = NULL;
+
+    err = nbd_serve(operation->path, &cache);
+    check_libusb(cache.error, "Unable to read from device");
+    check_errnum(-err, "Unable to serve NBD export");
+
+    device->progress = progress;
+
+    printf("Cache: %" PRIu64 " hits, %" PRIu64 " misses, 0x%" PRIx64 " bytes read from device\n", cache.hits, cache.misses, cache.fetched);
+
+    block_cache_finish(&cache);
 }
@@ -0,0 +1,388 @@
+#include "nbd.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Fixed newstyle handshake, see the NBD protocol specification */
+#define NBD_MAGIC           (0x4e42444d41474943ULL)
+#define NBD_IHAVEOPT        (0x49484156454f5054ULL)
+#define NBD_REPLY_MAGIC     (0x3e889045565a9ULL)
+#define NBD_REQUEST_MAGIC   (0x25609513)
+#define NBD_SIMPLE_REPLY    (0x67446698)
+
+enum {
+    NBD_FLAG_FIXED_NEWSTYLE = 0x1,
+    NBD_FLAG_NO_ZEROES      = 0x2,
+};
+
+enum {
+    NBD_FLAG_HAS_FLAGS = 0x1,
+    NBD_FLAG_READ_ONLY = 0x2,
+};
+
+enum {
+    NBD_OPT_EXPORT_NAME = 1,
+    NBD_OPT_ABORT       = 2,
+    NBD_OPT_INFO        = 6,
+    NBD_OPT_GO          = 7,
+};
+
+enum {
+    NBD_REP_ACK  = 1,
+    NBD_REP_INFO = 3,
+};
+
+#define NBD_REP_ERR_UNSUP (0x80000001U)
+
+enum {
+    NBD_INFO_EXPORT = 0,
+};
+
+enum {
+    NBD_CMD_READ  = 0,
+    NBD_CMD_WRITE = 1,
+    NBD_CMD_DISC  = 2,
+    NBD_CMD_FLUSH = 3,
+};
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t length;
+} __attribute__((packed));
+
+struct nbd_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t handle;
+} __attribute__((packed));
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void handle_signal(int signum);
+static int serve_client(int fd, struct block_cache *cache);
+static int handshake(int fd, const struct block_cache *cache, bool *done);
+static int transmission(int fd, struct block_cache *cache);
+static int option_reply(int fd, uint32_t option, uint32_t type, const void *data, uint32_t length);
+static int read_full(int fd, void *buffer, size_t count);
+static int write_full(int fd, const void *buffer, size_t count);
+static int discard(int fd, size_t count);
+
+int nbd_serve(const char *path, struct block_cache *cache) {
+    int err = 0;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -ENAMETOOLONG;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        return -errno;
+    }
+
+    unlink(path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        err = -errno;
+        close(sock);
+        return err;
+    }
+
+    /* Serve clients one at a time, until interrupted */
+    struct sigaction sa = { .sa_handler = handle_signal };
+    struct sigaction old_int, old_term;
+    sigaction(SIGINT, &sa, &old_int);
+    sigaction(SIGTERM, &sa, &old_term);
+
+    printf("Serving NBD export \"%s\" on %s, interrupt to stop\n", NBD_EXPORT_NAME, path);
+    fflush(stdout);
+
+    while (!interrupted) {
+        int fd;
+        if ((fd = accept(sock, NULL, NULL)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = -errno;
+            break;
+        }
+
+        err = serve_client(fd, cache);
+        if (cache->error < 0) {
+            err = cache->error;
+            close(fd);
+            break;
+        }
+        if (err < 0 && err != -EINTR && err != -EPIPE && err != -ECONNRESET) {
+            close(fd);
+            break;
+        }
+        err = 0;
+
+        close(fd);
+    }
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+
+    close(sock);
+    unlink(path);
+
+    return err;
+}
+
+static void handle_signal(int signum) {
+    (void) signum;
+    interrupted = 1;
+}
+
+static int serve_client(int fd, struct block_cache *cache) {
+    int err;
+
+    bool done = false;
+    if ((err = handshake(fd, cache, &done)) < 0 || done) {
+        return err;
+    }
+
+    return transmission(fd, cache);
+}
+
+static int handshake(int fd, const struct block_cache *cache, bool *done) {
+    int err;
+
+    struct __attribute__((packed)) {
+        uint64_t magic;
+        uint64_t opt_magic;
+        uint16_t flags;
+    } greeting = {
+        htobe64(NBD_MAGIC),
+        htobe64(NBD_IHAVEOPT),
+        htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+    };
+    if ((err = write_full(fd, &greeting, sizeof(greeting))) < 0) {
+        return err;
+    }
+
+    uint32_t client_flags;
+    if ((err = read_full(fd, &client_flags, sizeof(client_flags))) < 0) {
+        return err;
+    }
+    bool no_zeroes = be32toh(client_flags) & NBD_FLAG_NO_ZEROES;
+
+    uint16_t transmission_flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY;
+
+    while (true) {
+        struct __attribute__((packed)) {
+            uint64_t magic;
+            uint32_t option;
+            uint32_t length;
+        } header;
+        if ((err = read_full(fd, &header, sizeof(header))) < 0) {
+            return err;
+        }
+        if (be64toh(header.magic) != NBD_IHAVEOPT) {
+            return -EPROTO;
+        }
+
+        uint32_t option = be32toh(header.option);
+        uint32_t length = be32toh(header.length);
+
+        /* Every export name refers to the same export, so option data is not needed */
+        if ((err = discard(fd, length)) < 0) {
+            return err;
+        }
+
+        switch (option) {
+            case NBD_OPT_EXPORT_NAME: {
+                struct __attribute__((packed)) {
+                    uint64_t size;
+                    uint16_t flags;
+                    uint8_t zeroes[124];
+                } reply = { htobe64(cache->length), htobe16(transmission_flags), { 0 } };
+                return write_full(fd, &reply, no_zeroes ? sizeof(reply) - sizeof(reply.zeroes) : sizeof(reply));
+            }
+
+            case NBD_OPT_ABORT:
+                *done = true;
+                return option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+
+            case NBD_OPT_INFO:
+            case NBD_OPT_GO: {
+                struct __attribute__((packed)) {
+                    uint16_t type;
+                    uint64_t size;
+                    uint16_t flags;
+                } info = { htobe16(NBD_INFO_EXPORT), htobe64(cache->length), htobe16(transmission_flags) };
+                if ((err = option_reply(fd, option, NBD_REP_INFO, &info, sizeof(info))) < 0) {
+                    return err;
+                }
+                if ((err = option_reply(fd, option, NBD_REP_ACK, NULL, 0)) < 0) {
+                    return err;
+                }
+                if (option == NBD_OPT_GO) {
+                    return 0;
+                }
+                break;
+            }
+
+            default:
+                if ((err = option_reply(fd, option, NBD_REP_ERR_UNSUP, NULL, 0)) < 0) {
+                    return err;
+                }
+                break;
+        }
+    }
+}
+
+static int transmission(int fd, struct block_cache *cache) {
+    int err;
+
+    uint8_t *buffer;
+    if ((buffer = malloc(NBD_MAX_REQUEST)) == NULL) {
+        return -errno;
+    }
+
+    while (true) {
+        struct nbd_request request;
+        if ((err = read_full(fd, &request, sizeof(request))) < 0) {
+            break;
+        }
+        if (be32toh(request.magic) != NBD_REQUEST_MAGIC) {
+            err = -EPROTO;
+            break;
+        }
+
+        uint16_t type = be16toh(request.type);
+        uint64_t offset = be64toh(request.offset);
+        uint32_t length = be32toh(request.length);
+
+        if (type == NBD_CMD_DISC) {
+            err = 0;
+            break;
+        }
+
+        struct nbd_reply reply = { htobe32(NBD_SIMPLE_REPLY), 0, request.handle };
+        bool data = false;
+
+        switch (type) {
+            case NBD_CMD_READ:
+                if (length > NBD_MAX_REQUEST || offset > cache->length || length > cache->length - offset) {
+                    reply.error = htobe32(EINVAL);
+                } else if ((err = block_cache_read(cache, offset, buffer, length)) < 0) {
+                    /* The DA may be part way through a transfer, later reads would take its data as replies */
+                    goto out;
+                } else {
+                    data = true;
+                }
+                break;
+
+            case NBD_CMD_WRITE:
+                /* The export is read-only, but the payload still has to be consumed */
+                if ((err = discard(fd, length)) < 0) {
+                    goto out;
+                }
+                reply.error = htobe32(EPERM);
+                break;
+
+            case NBD_CMD_FLUSH:
+                break;
+
+            default:
+                reply.error = htobe32(EINVAL);
+                break;
+        }
+
+        if ((err = write_full(fd, &reply, sizeof(reply))) < 0) {
+            break;
+        }
+        if (data && (err = write_full(fd, buffer, length)) < 0) {
+            break;
+        }
+    }
+
+out:
+    free(buffer);
+
+    return err;
+}
+
+static int option_reply(int fd, uint32_t option, uint32_t type, const void *data, uint32_t length) {
+    int err;
+
+    struct __attribute__((packed)) {
+        uint64_t magic;
+        uint32_t option;
+        uint32_t type;
+        uint32_t length;
+    } reply = { htobe64(NBD_REPLY_MAGIC), htobe32(option), htobe32(type), htobe32(length) };
+
+    if ((err = write_full(fd, &reply, sizeof(reply))) < 0) {
+        return err;
+    }
+
+    return write_full(fd, data, length);
+}
+
+static int read_full(int fd, void *buffer, size_t count) {
+    uint8_t *ptr = buffer;
+
+    while (count > 0) {
+        ssize_t n;
+        if ((n = read(fd, ptr, count)) < 0) {
+            return -errno;
+        }
+        if (n == 0) {
+            return -ECONNRESET;
+        }
+
+        ptr += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int write_full(int fd, const void *buffer, size_t count) {
+    const uint8_t *ptr = buffer;
+
+    while (count > 0) {
+        ssize_t n;
+        if ((n = send(fd, ptr, count, MSG_NOSIGNAL)) < 0) {
+            return -errno;
+        }
+
+        ptr += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int discard(int fd, size_t count) {
+    uint8_t buffer[0x1000];
+
+    while (count > 0) {
+        size_t n = count < sizeof(buffer) ? count : sizeof(buffer);
+
+        int err;
+        if ((err = read_full(fd, buffer, n)) < 0) {
+            return err;
+        }
+
+        count -= n;
+    }
+
+    return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef NBD_H
+#define NBD_H
+
+#include "block_cache.h"
+
+#define NBD_EXPORT_NAME "mtk"
+#define NBD_MAX_REQUEST (0x2000000)
+
+/* Returns a negative errno, or the libusb error in cache->error if reading from the device failed */
+int nbd_serve(const char *path, struct block_cache *cache);
+
+#endif /* NBD_H */
@@ -0,0 +1,88 @@
+#include "progress.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROGRESS_BAR_WIDTH (32)
+#define SI_UNITS_BUFSIZ (16)
+#define ETA_BUFSIZ (32)
+
+static void print_progress_bar(const mtk_progress_report *report, void *user_data);
+static void print_progress_machine(const mtk_progress_report *report, void *user_data);
+static void format_si_units(uint64_t length, char *str, size_t size);
+
+bool progress_init(mtk_progress *progress, bool machine_readable) {
+    if (machine_readable) {
+        mtk_progress_init(progress, MTK_PROGRESS_DEFAULT_HZ, print_progress_machine, NULL);
+        return true;
+    }
+
+    if (!isatty(STDERR_FILENO)) {
+        return false;
+    }
+
+    mtk_progress_init(progress, MTK_PROGRESS_DEFAULT_HZ, print_progress_bar, NULL);
+    return true;
+}
+
+static void print_progress_bar(const mtk_progress_report *report, void *user_data) {
+    (void) user_data;
+
+    double progress = (double) report->offset / report->total;
+
+    char progress_bar[PROGRESS_BAR_WIDTH + 1];
+
+    size_t progress_bar_fill = progress * PROGRESS_BAR_WIDTH;
+    memset(progress_bar, '#', progress_bar_fill);
+    memset(progress_bar + progress_bar_fill, '-', PROGRESS_BAR_WIDTH - progress_bar_fill);
+    progress_bar[PROGRESS_BAR_WIDTH] = '\0';
+
+    const char *verb = report->flashing ? "Flashing" : "Dumping";
+    int percent = progress * 100;
+
+    char offset_str[SI_UNITS_BUFSIZ];
+    format_si_units(report->offset, offset_str, sizeof(offset_str));
+    char length_str[SI_UNITS_BUFSIZ];
+    format_si_units(report->total, length_str, sizeof(length_str));
+
+    bool done = (report->offset == report->total);
+
+    /* Show the average rate once complete, and the current rate while in progress */
+    double rate = (done ? report->average_rate : report->rate) / 1e6;
+
+    char eta_str[ETA_BUFSIZ];
+    if (done) {
+        snprintf(eta_str, sizeof(eta_str), "%.1fs", report->elapsed);
+    } else if (report->eta >= 0) {
+        snprintf(eta_str, sizeof(eta_str), "ETA %ld:%02ld", (long) report->eta / 60, (long) report->eta % 60);
+    } else {
+        snprintf(eta_str, sizeof(eta_str), "ETA --:--");
+    }
+
+    fprintf(stderr, "%s %-8s of %-8s  [%s]  %3d%%  %6.2f MB/s  %-10s%c", verb, offset_str, length_str, progress_bar, percent, rate, eta_str, done ? '\n' : '\r');
+    fflush(stderr);
+}
+
+static void print_progress_machine(const mtk_progress_report *report, void *user_data) {
+    (void) user_data;
+
+    fprintf(stderr, "progress op=%s offset=%" PRIu64 " total=%" PRIu64 " elapsed=%.3f rate=%.0f avg_rate=%.0f eta=%.1f\n",
+            report->flashing ? "flash" : "dump", report->offset, report->total,
+            report->elapsed, report->rate, report->average_rate, report->eta);
+}
+
+static void format_si_units(uint64_t length, char *str, size_t size) {
+    static const char *suffix = "BKMG";
+
+    double dbl = length;
+    const char *ptr = suffix;
+
+    while (dbl > 1024 && *(ptr + 1) != '\0') {
+        dbl /= 1024;
+        ptr++;
+    }
+
+    snprintf(str, size, "%.5g %c", dbl, *ptr);
+}
@@ -0,0 +1,10 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdbool.h>
+
+#include "mtk_progress.h"
+
+bool progress_init(mtk_progress *progress, bool machine_readable);
+
+#endif /* PROGRESS_H */
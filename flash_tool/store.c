@@ -0,0 +1,231 @@
+#include "store.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+static int write_all(int fd, const uint8_t *buffer, size_t count);
+static int commit_chunk(struct store *store, const uint8_t *data, size_t count);
+static int sync_subdir(struct store *store, uint8_t index);
+
+int store_open(struct store *store, const char *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    if ((store->dirfd = open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+        return -errno;
+    }
+
+    if ((store->buffer = malloc(STORE_CHUNK_SIZE)) == NULL) {
+        int err = -errno;
+        close(store->dirfd);
+        return err;
+    }
+
+    store->recipe_fd = -1;
+    store->buffer_used = 0;
+
+    return 0;
+}
+
+void store_close(struct store *store) {
+    free(store->buffer);
+    close(store->dirfd);
+}
+
+int store_begin(struct store *store, int recipe_fd, uint64_t address, uint64_t length) {
+    store->recipe_fd = recipe_fd;
+    store->buffer_used = 0;
+    store->chunks = 0;
+    store->new_chunks = 0;
+    store->new_bytes = 0;
+    memset(store->dirty, 0, sizeof(store->dirty));
+
+    struct recipe_header header = {
+        .version = RECIPE_VERSION,
+        .chunk_size = STORE_CHUNK_SIZE,
+        .address = address,
+        .length = length,
+    };
+    memcpy(header.magic, RECIPE_MAGIC, sizeof(header.magic));
+
+    return write_all(recipe_fd, (const uint8_t *) &header, sizeof(header));
+}
+
+int store_finish(struct store *store) {
+    int err;
+
+    /* The last chunk may be short */
+    if (store->buffer_used > 0) {
+        if ((err = commit_chunk(store, store->buffer, store->buffer_used)) < 0) {
+            return err;
+        }
+        store->buffer_used = 0;
+    }
+
+    /* The renames must be on disk before the recipe that refers to the chunks */
+    for (unsigned int i = 0; i < 8 * sizeof(store->dirty); i++) {
+        if (store->dirty[i / 8] & (1 << (i % 8))) {
+            if ((err = sync_subdir(store, i)) < 0) {
+                return err;
+            }
+        }
+    }
+    if (fsync(store->dirfd) < 0) {
+        return -errno;
+    }
+
+    /* The recipe may be a pipe, which cannot be synced */
+    if (fsync(store->recipe_fd) < 0 && errno != EINVAL) {
+        return -errno;
+    }
+
+    return 0;
+}
+
+int store_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) offset;
+    (void) total_length;
+
+    struct store *store = user_data;
+
+    if (flashing) {
+        errx(1, "Chunk store handler cannot be used for flashing");
+    }
+
+    int err;
+
+    while (count > 0) {
+        if (store->buffer_used == 0 && count >= STORE_CHUNK_SIZE) {
+            /* Whole chunks are stored straight from the DA buffer */
+            if ((err = commit_chunk(store, buffer, STORE_CHUNK_SIZE)) < 0) {
+                errx(1, "Unable to store chunk: %s", strerror(-err));
+            }
+
+            buffer += STORE_CHUNK_SIZE;
+            count -= STORE_CHUNK_SIZE;
+            continue;
+        }
+
+        size_t n = STORE_CHUNK_SIZE - store->buffer_used;
+        if (n > count) {
+            n = count;
+        }
+
+        memcpy(store->buffer + store->buffer_used, buffer, n);
+        store->buffer_used += n;
+
+        if (store->buffer_used == STORE_CHUNK_SIZE) {
+            if ((err = commit_chunk(store, store->buffer, STORE_CHUNK_SIZE)) < 0) {
+                errx(1, "Unable to store chunk: %s", strerror(-err));
+            }
+            store->buffer_used = 0;
+        }
+
+        buffer += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *buffer, size_t count) {
+    while (count > 0) {
+        ssize_t n;
+        if ((n = write(fd, buffer, count)) < 0) {
+            return -errno;
+        }
+
+        buffer += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int commit_chunk(struct store *store, const uint8_t *data, size_t count) {
+    int err;
+
+    uint8_t digest[STORE_DIGEST_SIZE];
+    SHA256(data, count, digest);
+
+    char subdir[3];
+    char name[3 + 2 * STORE_DIGEST_SIZE];
+    snprintf(subdir, sizeof(subdir), "%02x", digest[0]);
+    snprintf(name, sizeof(name), "%s/", subdir);
+    for (size_t i = 1; i < STORE_DIGEST_SIZE; i++) {
+        snprintf(name + 3 + 2 * (i - 1), 3, "%02x", digest[i]);
+    }
+
+    struct stat st;
+    if (fstatat(store->dirfd, name, &st, 0) == 0) {
+        /* Already stored, only the recipe grows */
+        goto done;
+    }
+    if (errno != ENOENT) {
+        return -errno;
+    }
+
+    if (mkdirat(store->dirfd, subdir, 0755) < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    /* Write to a temporary file first, so an interrupted backup never leaves a truncated chunk */
+    char tmp[sizeof(name) + 4];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", name);
+
+    int fd;
+    if ((fd = openat(store->dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return -errno;
+    }
+    if ((err = write_all(fd, data, count)) < 0) {
+        close(fd);
+        return err;
+    }
+    /* The data must be on disk before the rename makes the chunk visible */
+    if (fsync(fd) < 0) {
+        err = -errno;
+        close(fd);
+        return err;
+    }
+    if (close(fd) < 0) {
+        return -errno;
+    }
+    if (renameat(store->dirfd, tmp, store->dirfd, name) < 0) {
+        return -errno;
+    }
+    store->dirty[digest[0] / 8] |= 1 << (digest[0] % 8);
+
+    store->new_chunks++;
+    store->new_bytes += count;
+
+done:
+    store->chunks++;
+
+    return write_all(store->recipe_fd, digest, sizeof(digest));
+}
+
+static int sync_subdir(struct store *store, uint8_t index) {
+    char subdir[3];
+    snprintf(subdir, sizeof(subdir), "%02x", index);
+
+    int fd;
+    if ((fd = openat(store->dirfd, subdir, O_RDONLY | O_DIRECTORY)) < 0) {
+        return -errno;
+    }
+    if (fsync(fd) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+
+    return close(fd) < 0 ? -errno : 0;
+}
@@ -0,0 +1,52 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Chunks are stored by their SHA-256 digest as STORE/xx/yyyy..., where xx is
+ * the first byte of the digest in hex. Recipes start with a recipe_header,
+ * followed by the digest of each chunk in order. All fields are in host
+ * byte order.
+ */
+
+#define RECIPE_MAGIC "MTKRCP\r\n"
+#define RECIPE_VERSION (1)
+
+#define STORE_CHUNK_SIZE (0x100000)
+#define STORE_DIGEST_SIZE (32)
+
+struct recipe_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t address;
+    uint64_t length;
+} __attribute__((packed));
+
+struct store {
+    int dirfd;
+
+    int recipe_fd;
+    uint8_t *buffer;
+    size_t buffer_used;
+
+    uint64_t chunks;
+    uint64_t new_chunks;
+    uint64_t new_bytes;
+
+    /* Subdirectories that gained chunks, synced once when finishing */
+    uint8_t dirty[256 / 8];
+};
+
+int store_open(struct store *store, const char *path);
+void store_close(struct store *store);
+
+int store_begin(struct store *store, int recipe_fd, uint64_t address, uint64_t length);
+int store_finish(struct store *store);
+
+int store_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* STORE_H */
@@ -0,0 +1,295 @@
+#include "uring_file.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <liburing.h>
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_INFLIGHT,
+    SLOT_READY,
+};
+
+struct slot {
+    enum slot_state state;
+    size_t offset;
+    size_t count;
+    int result;
+};
+
+struct uring_file {
+    struct io_uring ring;
+    int fd;
+
+    struct slot slots[URING_FILE_DEPTH];
+    struct iovec iovecs[URING_FILE_DEPTH];
+    size_t inflight;
+
+    /* Next offset to read ahead from, when flashing */
+    size_t readahead;
+    /* First error reported by a completion, returned on the next call */
+    int error;
+};
+
+static int submit(struct uring_file *uf, size_t index, bool write, size_t offset, size_t count);
+static int reap(struct uring_file *uf, bool wait);
+static int drain(struct uring_file *uf);
+static int fill_readahead(struct uring_file *uf, size_t end);
+
+int uring_file_init(struct uring_file **uf, int fd) {
+    struct uring_file *ptr;
+    if ((ptr = calloc(1, sizeof(*ptr))) == NULL) {
+        return -errno;
+    }
+
+    ptr->fd = fd;
+
+    int err;
+    if ((err = io_uring_queue_init(URING_FILE_DEPTH, &ptr->ring, 0)) < 0) {
+        free(ptr);
+        return err;
+    }
+
+    size_t i;
+    for (i = 0; i < URING_FILE_DEPTH; i++) {
+        if ((err = -posix_memalign(&ptr->iovecs[i].iov_base, sysconf(_SC_PAGESIZE), URING_FILE_BUFSIZ)) < 0) {
+            break;
+        }
+        ptr->iovecs[i].iov_len = URING_FILE_BUFSIZ;
+    }
+
+    if (err == 0) {
+        err = io_uring_register_buffers(&ptr->ring, ptr->iovecs, URING_FILE_DEPTH);
+    }
+    if (err < 0) {
+        while (i-- > 0) {
+            free(ptr->iovecs[i].iov_base);
+        }
+        io_uring_queue_exit(&ptr->ring);
+        free(ptr);
+        return err;
+    }
+
+    *uf = ptr;
+
+    return 0;
+}
+
+int uring_file_finish(struct uring_file *uf) {
+    int err = drain(uf);
+
+    io_uring_unregister_buffers(&uf->ring);
+    io_uring_queue_exit(&uf->ring);
+
+    for (size_t i = 0; i < URING_FILE_DEPTH; i++) {
+        free(uf->iovecs[i].iov_base);
+    }
+    free(uf);
+
+    return err;
+}
+
+int uring_file_sync(struct uring_file *uf) {
+    return drain(uf);
+}
+
+int uring_file_read(struct uring_file *uf, size_t offset, size_t end, uint8_t *buffer, size_t count) {
+    int err;
+
+    struct slot *slot = NULL;
+    for (size_t i = 0; i < URING_FILE_DEPTH; i++) {
+        if (uf->slots[i].state != SLOT_FREE && uf->slots[i].offset == offset && uf->slots[i].count == count) {
+            slot = &uf->slots[i];
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        /* Not read ahead (first call, or access is not sequential), restart from here */
+        if ((err = drain(uf)) < 0) {
+            return err;
+        }
+        for (size_t i = 0; i < URING_FILE_DEPTH; i++) {
+            uf->slots[i].state = SLOT_FREE;
+        }
+
+        uf->readahead = offset;
+        if ((err = fill_readahead(uf, end)) < 0) {
+            return err;
+        }
+
+        slot = &uf->slots[0];
+        if (slot->state == SLOT_FREE || slot->offset != offset || slot->count != count) {
+            /* Chunk is larger than a buffer, fall back to a blocking read */
+            ssize_t n;
+            if ((n = pread(uf->fd, buffer, count, offset)) < 0) {
+                return -errno;
+            }
+            return (size_t) n == count ? 0 : -EIO;
+        }
+    }
+
+    while (slot->state == SLOT_INFLIGHT) {
+        if ((err = reap(uf, true)) < 0) {
+            return err;
+        }
+    }
+
+    if (slot->result < 0) {
+        return slot->result;
+    }
+    if ((size_t) slot->result != count) {
+        return -EIO;
+    }
+
+    memcpy(buffer, uf->iovecs[slot - uf->slots].iov_base, count);
+    slot->state = SLOT_FREE;
+
+    return fill_readahead(uf, end);
+}
+
+int uring_file_write(struct uring_file *uf, size_t offset, const uint8_t *buffer, size_t count) {
+    int err;
+
+    while (count > 0) {
+        if ((err = reap(uf, false)) < 0) {
+            return err;
+        }
+
+        size_t index = URING_FILE_DEPTH;
+        while (true) {
+            for (size_t i = 0; i < URING_FILE_DEPTH; i++) {
+                if (uf->slots[i].state != SLOT_INFLIGHT) {
+                    index = i;
+                    break;
+                }
+            }
+            if (index != URING_FILE_DEPTH) {
+                break;
+            }
+
+            /* All buffers are in flight, the disk is slower than the link */
+            if ((err = reap(uf, true)) < 0) {
+                return err;
+            }
+        }
+
+        size_t n = count < URING_FILE_BUFSIZ ? count : URING_FILE_BUFSIZ;
+        memcpy(uf->iovecs[index].iov_base, buffer, n);
+
+        if ((err = submit(uf, index, true, offset, n)) < 0) {
+            return err;
+        }
+
+        offset += n;
+        buffer += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int submit(struct uring_file *uf, size_t index, bool write, size_t offset, size_t count) {
+    struct io_uring_sqe *sqe;
+    if ((sqe = io_uring_get_sqe(&uf->ring)) == NULL) {
+        return -EBUSY;
+    }
+
+    struct slot *slot = &uf->slots[index];
+    void *buf = uf->iovecs[index].iov_base;
+
+    if (write) {
+        io_uring_prep_write_fixed(sqe, uf->fd, buf, count, offset, index);
+    } else {
+        io_uring_prep_read_fixed(sqe, uf->fd, buf, count, offset, index);
+    }
+    io_uring_sqe_set_data(sqe, slot);
+
+    slot->state = SLOT_INFLIGHT;
+    slot->offset = offset;
+    slot->count = count;
+
+    int err;
+    if ((err = io_uring_submit(&uf->ring)) < 0) {
+        slot->state = SLOT_FREE;
+        return err;
+    }
+
+    uf->inflight++;
+
+    return 0;
+}
+
+static int reap(struct uring_file *uf, bool wait) {
+    int err;
+
+    while (uf->inflight > 0) {
+        struct io_uring_cqe *cqe;
+
+        if ((err = wait ? io_uring_wait_cqe(&uf->ring, &cqe) : io_uring_peek_cqe(&uf->ring, &cqe)) < 0) {
+            if (err == -EAGAIN) {
+                break;
+            }
+            return err;
+        }
+
+        struct slot *slot = io_uring_cqe_get_data(cqe);
+        slot->result = cqe->res;
+        slot->state = SLOT_READY;
+        io_uring_cqe_seen(&uf->ring, cqe);
+        uf->inflight--;
+
+        if (uf->error == 0) {
+            if (slot->result < 0) {
+                uf->error = slot->result;
+            } else if ((size_t) slot->result != slot->count) {
+                uf->error = -EIO;
+            }
+        }
+
+        /* Only wait for a single completion, then pick up whatever else is ready */
+        wait = false;
+    }
+
+    return uf->error;
+}
+
+static int drain(struct uring_file *uf) {
+    int err;
+
+    while (uf->inflight > 0) {
+        if ((err = reap(uf, true)) < 0) {
+            return err;
+        }
+    }
+
+    return uf->error;
+}
+
+static int fill_readahead(struct uring_file *uf, size_t end) {
+    int err;
+
+    for (size_t i = 0; i < URING_FILE_DEPTH && uf->readahead < end; i++) {
+        if (uf->slots[i].state != SLOT_FREE) {
+            continue;
+        }
+
+        size_t count = end - uf->readahead;
+        if (count > URING_FILE_BUFSIZ) {
+            count = URING_FILE_BUFSIZ;
+        }
+
+        if ((err = submit(uf, i, false, uf->readahead, count)) < 0) {
+            return err;
+        }
+
+        uf->readahead += count;
+    }
+
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef URING_FILE_H
+#define URING_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define URING_FILE_DEPTH (8)
+#define URING_FILE_BUFSIZ (0x100000)
+
+struct uring_file;
+
+int uring_file_init(struct uring_file **uf, int fd);
+int uring_file_finish(struct uring_file *uf);
+int uring_file_sync(struct uring_file *uf);
+
+int uring_file_read(struct uring_file *uf, size_t offset, size_t end, uint8_t *buffer, size_t count);
+int uring_file_write(struct uring_file *uf, size_t offset, const uint8_t *buffer, size_t count);
+
+#endif /* URING_FILE_H */
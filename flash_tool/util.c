@@ -1,6 +1,7 @@
 #include "util.h"
 
 #include <err.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
@@ -21,6 +22,14 @@ void check_libusb(int errnum, const char *s) {
     }
 }
 
+void check_transfer(int errnum, int handler_errnum, const char *s) {
+    if (handler_errnum == -EBADMSG) {
+        errx(1, "%s: Wrong key or modified file", s);
+    }
+    check_errnum(-handler_errnum, s);
+    check_libusb(errnum, s);
+}
+
 void check_mtk_preloader(uint16_t status, const char *cmd) {
     if (status != 0) {
         errx(2, "%s failed: 0x%04" PRIx16, cmd, status);
@@ -3,8 +3,15 @@
 
 #include <stdint.h>
 
+#define MIN(X, Y) \
+    __extension__ ({ __typeof__(X) _X = (X); __typeof__(Y) _Y = (Y); _X < _Y ? _X : _Y; })
+#define MAX(X, Y) \
+    __extension__ ({ __typeof__(X) _X = (X); __typeof__(Y) _Y = (Y); _X > _Y ? _X : _Y; })
+
 void check_errnum(int errnum, const char *s);
 void check_libusb(int errnum, const char *s);
+/* A transfer fails when its handler does, report the handler's -errno rather than the transfer's error then */
+void check_transfer(int errnum, int handler_errnum, const char *s);
 
 void check_mtk_preloader(uint16_t status, const char *cmd);
 
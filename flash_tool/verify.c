@@ -0,0 +1,96 @@
+#include "verify.h"
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/* Granularity of the vectorised compare, mismatching blocks are then compared bytewise */
+#define VERIFY_BLOCK_SIZE (4096)
+
+static void end_mismatch(struct verify_info *vi, size_t offset);
+
+int verify_init(struct verify_info *vi, int fd, uint64_t address, uint64_t length) {
+    vi->address = address;
+    vi->length = length;
+    vi->in_mismatch = false;
+    vi->mismatch_ranges = 0;
+    vi->mismatch_bytes = 0;
+
+    void *data;
+    if ((data = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        return -errno;
+    }
+    madvise(data, length, MADV_SEQUENTIAL);
+
+    vi->data = data;
+
+    return 0;
+}
+
+void verify_finish(struct verify_info *vi) {
+    end_mismatch(vi, vi->length);
+
+    if (vi->mismatch_ranges > VERIFY_MAX_REPORTED) {
+        printf("... %zu more mismatching ranges\n", vi->mismatch_ranges - VERIFY_MAX_REPORTED);
+    }
+
+    munmap((void *) vi->data, vi->length);
+}
+
+int verify_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) total_length;
+
+    struct verify_info *vi = user_data;
+
+    if (flashing) {
+        errx(1, "Verification handler cannot be used for flashing");
+    }
+
+    const uint8_t *expected = vi->data + offset;
+
+    /* Fast path, the whole chunk matches */
+    if (!vi->in_mismatch && memcmp(buffer, expected, count) == 0) {
+        return 0;
+    }
+
+    for (size_t block = 0; block < count; block += VERIFY_BLOCK_SIZE) {
+        size_t n = count - block < VERIFY_BLOCK_SIZE ? count - block : VERIFY_BLOCK_SIZE;
+
+        if (!vi->in_mismatch && memcmp(buffer + block, expected + block, n) == 0) {
+            continue;
+        }
+
+        for (size_t i = block; i < block + n; i++) {
+            bool match = (buffer[i] == expected[i]);
+
+            if (!match && !vi->in_mismatch) {
+                vi->in_mismatch = true;
+                vi->mismatch_start = offset + i;
+            } else if (match && vi->in_mismatch) {
+                end_mismatch(vi, offset + i);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void end_mismatch(struct verify_info *vi, size_t offset) {
+    if (!vi->in_mismatch) {
+        return;
+    }
+
+    uint64_t length = offset - vi->mismatch_start;
+
+    if (vi->mismatch_ranges < VERIFY_MAX_REPORTED) {
+        printf("Mismatch: 0x%016" PRIx64 "-0x%016" PRIx64 " (0x%" PRIx64 " bytes)\n",
+                vi->address + vi->mismatch_start, vi->address + offset, length);
+    }
+
+    vi->in_mismatch = false;
+    vi->mismatch_ranges++;
+    vi->mismatch_bytes += length;
+}
@@ -0,0 +1,28 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VERIFY_MAX_REPORTED (64)
+
+struct verify_info {
+    const uint8_t *data;
+    size_t length;
+    uint64_t address;
+
+    /* Start of the mismatching range being extended, if any */
+    bool in_mismatch;
+    uint64_t mismatch_start;
+
+    size_t mismatch_ranges;
+    uint64_t mismatch_bytes;
+};
+
+int verify_init(struct verify_info *vi, int fd, uint64_t address, uint64_t length);
+void verify_finish(struct verify_info *vi);
+
+int verify_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* VERIFY_H */
@@ -0,0 +1,107 @@
+#include "zero_ranges.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static bool is_zero(const uint8_t *buffer, size_t count) {
+    /* Every byte equals the next, and the first is zero */
+    return count == 0 || (buffer[0] == 0 && memcmp(buffer, buffer + 1, count - 1) == 0);
+}
+
+static int add_range(struct zero_ranges *zr, size_t *capacity, uint64_t offset, uint64_t length) {
+    if (zr->count == *capacity) {
+        size_t new_capacity = *capacity != 0 ? *capacity * 2 : 16;
+
+        struct zero_range *ranges;
+        if ((ranges = realloc(zr->ranges, new_capacity * sizeof(*ranges))) == NULL) {
+            return -errno;
+        }
+
+        zr->ranges = ranges;
+        *capacity = new_capacity;
+    }
+
+    zr->ranges[zr->count].offset = offset;
+    zr->ranges[zr->count].length = length;
+    zr->count++;
+
+    return 0;
+}
+
+int zero_ranges_find(struct zero_ranges *zr, int fd, uint64_t address, uint64_t length, uint64_t block_size) {
+    zr->ranges = NULL;
+    zr->count = 0;
+
+    uint8_t *buffer;
+    if ((buffer = malloc(block_size)) == NULL) {
+        return -errno;
+    }
+
+    size_t capacity = 0;
+    int err = 0;
+
+    /* Only whole blocks can be erased, partial blocks at either end are always written */
+    uint64_t offset = (block_size - address % block_size) % block_size;
+    uint64_t run_start = offset;
+
+    while (offset + block_size <= length) {
+        size_t done = 0;
+        while (done < block_size) {
+            ssize_t n = pread(fd, buffer + done, block_size - done, offset + done);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                err = n < 0 ? -errno : -EIO;
+                break;
+            }
+            done += n;
+        }
+        if (err < 0) {
+            break;
+        }
+
+        bool zero = is_zero(buffer, block_size);
+        offset += block_size;
+
+        if (zero && offset + block_size <= length) {
+            continue;
+        }
+
+        /* The run ends here, either on data or at the last whole block */
+        uint64_t run_end = zero ? offset : offset - block_size;
+        if (run_end - run_start >= ZERO_RANGES_MIN_LENGTH && (err = add_range(zr, &capacity, run_start, run_end - run_start)) < 0) {
+            break;
+        }
+        run_start = offset;
+    }
+
+    free(buffer);
+
+    if (err < 0) {
+        zero_ranges_free(zr);
+    }
+
+    return err;
+}
+
+void zero_ranges_free(struct zero_ranges *zr) {
+    free(zr->ranges);
+    zr->ranges = NULL;
+    zr->count = 0;
+}
+
+int zero_check_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    (void) flashing;
+    (void) offset;
+    (void) total_length;
+
+    bool *zero = user_data;
+    if (!is_zero(buffer, count)) {
+        *zero = false;
+    }
+
+    return 0;
+}
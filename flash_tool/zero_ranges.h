@@ -0,0 +1,28 @@
+#ifndef ZERO_RANGES_H
+#define ZERO_RANGES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Shorter runs of zeros are cheaper to write than to erase */
+#define ZERO_RANGES_MIN_LENGTH (0x400000)
+
+struct zero_range {
+    /* Relative to the start of the operation */
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct zero_ranges {
+    struct zero_range *ranges;
+    size_t count;
+};
+
+int zero_ranges_find(struct zero_ranges *zr, int fd, uint64_t address, uint64_t length, uint64_t block_size);
+void zero_ranges_free(struct zero_ranges *zr);
+
+/* Clears the bool pointed to by user_data if any byte read is not zero */
+int zero_check_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* ZERO_RANGES_H */
@@ -0,0 +1,71 @@
+#ifndef MTK_CAPTURE_H
+#define MTK_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Capture files start with an mtk_capture_header, followed by one
+ * mtk_capture_record per USB transfer. Each record is followed by the
+ * payload, or by its 64-bit FNV-1a hash if the payload was longer than the
+ * payload limit. Control transfer payloads start with the 8 byte setup
+ * packet. All fields are in host byte order.
+ */
+
+#define MTK_CAPTURE_MAGIC "MTKCAP\r\n"
+#define MTK_CAPTURE_VERSION (1)
+
+#define MTK_CAPTURE_DEFAULT_PAYLOAD_LIMIT (64)
+
+#define MTK_CAPTURE_BUFSIZ (0x100000)
+
+enum {
+    MTK_CAPTURE_BULK_IN = 1,
+    MTK_CAPTURE_BULK_OUT,
+    MTK_CAPTURE_CONTROL,
+};
+
+enum {
+    MTK_CAPTURE_FLAG_HASHED = 0x1,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t payload_limit;
+} __attribute__((packed)) mtk_capture_header;
+
+typedef struct {
+    /* CLOCK_MONOTONIC at the start of the transfer */
+    uint64_t timestamp_ns;
+    uint32_t duration_ns;
+    uint8_t type;
+    uint8_t flags;
+    /* libusb return value */
+    int16_t status;
+    uint32_t requested;
+    uint32_t length;
+} __attribute__((packed)) mtk_capture_record;
+
+typedef struct {
+    int fd;
+    uint32_t payload_limit;
+
+    uint8_t *buffer;
+    size_t buffer_used;
+
+    /* First write error, later records are dropped */
+    int error;
+} mtk_capture;
+
+#define MTK_FNV1A64_INIT (0xcbf29ce484222325ULL)
+
+uint64_t mtk_fnv1a64(uint64_t hash, const uint8_t *data, size_t len);
+
+int mtk_capture_init(mtk_capture *capture, int fd, uint32_t payload_limit);
+int mtk_capture_finish(mtk_capture *capture);
+
+void mtk_capture_transfer(mtk_capture *capture, uint8_t type, uint64_t timestamp_ns, uint64_t duration_ns, int status,
+        const uint8_t *setup, size_t requested, const uint8_t *data, size_t length);
+
+#endif /* MTK_CAPTURE_H */
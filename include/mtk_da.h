@@ -2,6 +2,7 @@
 #define MTK_DA_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "mtk_device.h"
@@ -24,7 +25,9 @@ enum {
 enum {
     MTK_DA_SWITCH_PART_CMD      = 0x60,
     MTK_DA_SDMMC_WRITE_DATA_CMD = 0x62,
+    MTK_DA_USB_SETUP_PORT_CMD   = 0x70,
     MTK_DA_USB_CHECK_STATUS_CMD = 0x72,
+    MTK_DA_FORMAT_CMD           = 0xd4,
     MTK_DA_READ_CMD             = 0xd6,
     MTK_DA_ENABLE_WATCHDOG_CMD  = 0xdb,
 };
@@ -33,6 +36,32 @@ enum {
 
 #define MTK_DA_FULL_REPORT_SIZE (235)
 
+/* The EMMC block is followed by the SDMMC (0x1c), config (0x26) and pass (0xa) blocks */
+#define MTK_DA_REPORT_EMMC_SIZE (0x5c)
+#define MTK_DA_REPORT_EMMC_OFFSET (MTK_DA_FULL_REPORT_SIZE - MTK_DA_REPORT_EMMC_SIZE - 0x1c - 0x26 - 0xa)
+
+#define MTK_DA_EMMC_GP_PARTS (4)
+
+/* High-capacity erase group with HC_ERASE_GRP_SIZE of 1, the DA report does not include EXT_CSD */
+#define MTK_DA_EMMC_ERASE_GROUP (0x80000)
+
+/* DA Stage 2 answers commands immediately, the Preloader does not answer DA commands at all */
+#define MTK_DA_PROBE_TMOUT (100)
+
+/* Erasing reports progress in percent, a large range may take a while between reports */
+#define MTK_DA_FORMAT_TMOUT (60000)
+
+/* Size of the chunks read and written between checksums */
+#define MTK_DA_CHUNK_SIZE (0x100000)
+
+/* Attempts to resend a chunk that failed its checksum or, when dumping, timed out */
+#define MTK_DA_MAX_RETRIES (3)
+
+enum {
+    MTK_DA_USB_FULL_SPEED = 0,
+    MTK_DA_USB_HIGH_SPEED,
+};
+
 enum {
     MTK_DA_HW_STORAGE_NOR = 0,
     MTK_DA_HW_STORAGE_NAND,
@@ -93,15 +122,37 @@ typedef struct {
     mtk_da_entry DA[];
 } __attribute__((packed)) mtk_da_info;
 
-int mtk_da_info_load(int fd, const mtk_da_info **info);
+typedef struct {
+    uint32_t ret;
+    uint64_t boot1_size;
+    uint64_t boot2_size;
+    uint64_t rpmb_size;
+    uint64_t gp_size[MTK_DA_EMMC_GP_PARTS];
+    uint64_t ua_size;
+    uint32_t cid[4];
+    uint8_t fwver[8];
+} mtk_da_emmc_info;
+
+int mtk_da_info_load(int fd, const mtk_da_info **info, size_t *size);
+int mtk_da_info_region(const mtk_da_info *info, size_t size, const mtk_da_load_region *region, const uint8_t **data);
+
+uint16_t mtk_da_checksum(const uint8_t *data, size_t len);
 
 int mtk_da_sync(mtk_device *device, uint32_t *nand_ret, uint32_t *emmc_ret, uint32_t *emmc_id, uint8_t *da_major_ver, uint8_t *da_minor_ver);
-int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint8_t *retval, const mtk_io_handler handler, void *user_data);
+int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, const uint8_t *data, uint8_t *retval);
+int mtk_da_read_report(mtk_device *device, mtk_da_emmc_info *emmc, uint8_t *retval);
 
 int mtk_da_usb_check_status(mtk_device *device, uint8_t *usb_status, uint8_t *retval);
+/* Only safe for a device that has just booted into the Preloader, or runs DA Stage 2 */
+int mtk_da_probe(mtk_device *device, bool *running);
+/* The DA re-enumerates at the new speed once it has answered */
+int mtk_da_usb_setup_port(mtk_device *device, uint8_t speed, uint8_t *retval);
 
 int mtk_da_sdmmc_switch_part(mtk_device *device, uint8_t part, uint8_t *retval);
-int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data);
+/* Chunks are aligned to erase_group, which divides MTK_DA_CHUNK_SIZE or is a multiple of it, unless it is 0 */
+int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint64_t erase_group, uint8_t *retval, const mtk_io_handler handler, void *user_data);
+/* retval is not ACK if the DA does not support erasing, or rejected the range */
+int mtk_da_format(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval);
 int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data);
 
 int mtk_da_enable_watchdog(mtk_device *device, uint16_t timeout_ms, bool async, bool reboot, bool download_mode, bool no_reset_rtc_time, uint8_t *retval);
@@ -7,9 +7,19 @@
 
 #include <libusb.h>
 
+#include "mtk_capture.h"
+#include "mtk_progress.h"
+#include "mtk_stats.h"
+
 #define MTK_DEVICE_PKTSIZE (512)
 
 #define MTK_DEVICE_TMOUT (1000)
+/* Short timeout used to detect that the IN endpoint has gone quiet */
+#define MTK_DEVICE_DISCARD_TMOUT (100)
+/* The DA drops off the bus to switch speed, and takes about a second to come back */
+#define MTK_DEVICE_REATTACH_TMOUT (10000)
+/* Upper bound on a single wait for hotplug events, so the deadline is checked regularly */
+#define MTK_DEVICE_DETECT_POLL_TMOUT (100)
 
 #define MTK_DEVICE_INTERFACE (0)
 
@@ -19,27 +29,56 @@
 #define MTK_DEVICE_VID (0x0e8d)
 #define MTK_DEVICE_PID (0x2000)
 
+/* Alternative to libusb, e.g. for replaying captured sessions */
+typedef struct {
+    int (*bulk_transfer)(void *ctx, uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout);
+    int (*control_transfer)(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout);
+} mtk_transport;
+
 typedef struct {
     libusb_device_handle *dev;
 
+    const mtk_transport *transport;
+    void *transport_ctx;
+
     uint8_t buffer[MTK_DEVICE_PKTSIZE];
     size_t buffer_available;
     size_t buffer_offset;
+
+    /* Optional progress channel for data transfers */
+    mtk_progress *progress;
+    /* Optional session telemetry */
+    mtk_stats *stats;
+    /* Optional capture of every USB transfer */
+    mtk_capture *capture;
 } mtk_device;
 
 typedef int (*mtk_io_handler)(bool, size_t, size_t, uint8_t *, size_t, void *);
 
 int mtk_device_open(mtk_device *device, libusb_device_handle *dev);
+void mtk_device_open_transport(mtk_device *device, const mtk_transport *transport, void *ctx);
+
+/* Timeout is in milliseconds, 0 waits forever */
+int mtk_device_detect(mtk_device *device, libusb_context *ctx, unsigned int timeout);
+/* Waits for the device to come back after re-enumerating, keeping progress, telemetry and capture */
+int mtk_device_reattach(mtk_device *device, libusb_context *ctx, unsigned int timeout);
+void mtk_device_close(mtk_device *device);
 
-int mtk_device_detect(mtk_device *device, libusb_context *ctx);
+/* Negotiated link speed, LIBUSB_SPEED_UNKNOWN for other transports */
+int mtk_device_speed(const mtk_device *device);
+
+int mtk_device_control_transfer(mtk_device *device, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout);
 
 int mtk_device_read(mtk_device *device, uint8_t *buffer, size_t size);
+int mtk_device_read_timeout(mtk_device *device, uint8_t *buffer, size_t size, unsigned int timeout);
 int mtk_device_write(mtk_device *device, const uint8_t *buffer, size_t size);
 
 static inline void mtk_device_flush_buffer(mtk_device *device) {
     device->buffer_available = 0;
 }
 
+int mtk_device_discard(mtk_device *device);
+
 int mtk_device_read8(mtk_device *device, uint8_t *data);
 int mtk_device_read16(mtk_device *device, uint16_t *data);
 int mtk_device_read32(mtk_device *device, uint32_t *data);
@@ -0,0 +1,83 @@
+#ifndef MTK_PIPELINE_H
+#define MTK_PIPELINE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+/*
+ * A pipeline is an mtk_io_handler that passes every chunk to a list of
+ * stages. Inline stages run in order on the transfer thread, so one of them
+ * can fill the buffer when flashing. The chunk is then copied once into a
+ * reference counted buffer shared by all threaded stages, each of which sees
+ * every chunk in order on its own thread. Transfers run at the speed of the
+ * slowest stage, and block once all buffers are in flight.
+ */
+
+#define MTK_PIPELINE_MAX_STAGES (8)
+#define MTK_PIPELINE_DEFAULT_DEPTH (8)
+
+typedef struct mtk_pipeline mtk_pipeline;
+
+typedef struct {
+    bool flashing;
+    size_t offset;
+    size_t total_length;
+    size_t count;
+
+    uint8_t *data;
+    size_t capacity;
+
+    /* Threaded stages that have yet to release the chunk */
+    size_t refs;
+} mtk_pipeline_chunk;
+
+typedef struct {
+    mtk_pipeline *pipeline;
+    mtk_io_handler handler;
+    void *user_data;
+    bool threaded;
+
+    pthread_t thread;
+    pthread_cond_t queued;
+
+    /* Ring of chunks waiting for this stage, a chunk is queued at most once */
+    mtk_pipeline_chunk **queue;
+    size_t queue_head;
+    size_t queue_count;
+
+    /* Stage returned an error, later chunks are released without calling it */
+    bool failed;
+} mtk_pipeline_stage;
+
+struct mtk_pipeline {
+    mtk_pipeline_stage stages[MTK_PIPELINE_MAX_STAGES];
+    size_t stages_count;
+    size_t threaded_count;
+
+    mtk_pipeline_chunk *chunks;
+    mtk_pipeline_chunk **free_chunks;
+    size_t depth;
+    size_t free_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    bool done;
+
+    /* First error returned by any stage, the transfer only sees that its handler failed */
+    int error;
+};
+
+/* Depth is the number of chunks that can be in flight between the transfer and the threaded stages */
+int mtk_pipeline_init(mtk_pipeline *pipeline, size_t depth);
+int mtk_pipeline_add_stage(mtk_pipeline *pipeline, mtk_io_handler handler, void *user_data, bool threaded);
+/* Waits for the threaded stages to drain their queues, and returns the first error */
+int mtk_pipeline_finish(mtk_pipeline *pipeline);
+
+/* Handler for mtk_da_read and mtk_da_sdmmc_write_data, user_data is the pipeline */
+int mtk_pipeline_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data);
+
+#endif /* MTK_PIPELINE_H */
@@ -3,6 +3,7 @@
 
 #include "mtk_device.h"
 
+#include <stddef.h>
 #include <stdint.h>
 
 enum {
@@ -15,6 +16,13 @@ enum {
     MTK_PRELOADER_CMD_GET_TARGET_CONFIG = 0xd8,
 };
 
+/* The Preloader answers each start byte immediately, a slow reply is as good as a wrong one */
+#define MTK_PRELOADER_START_TMOUT (50)
+/* Restarts of the start sequence before giving up */
+#define MTK_PRELOADER_START_ATTEMPTS (40)
+
+uint16_t mtk_preloader_checksum(const uint8_t *data, size_t len);
+
 int mtk_preloader_start(mtk_device *device);
 
 int mtk_preloader_get_tgt_config(mtk_device *device, uint32_t *tgt_config, uint16_t *status);
@@ -26,7 +34,7 @@ int mtk_preloader_write32(mtk_device *device, uint32_t base_addr, uint32_t len32
 
 int mtk_preloader_disable_wdt(mtk_device *device, uint16_t *status);
 
-int mtk_preloader_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, uint16_t *status, const mtk_io_handler handler, void *user_data);
+int mtk_preloader_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint32_t sig_len, const uint8_t *data, uint16_t *status);
 int mtk_preloader_jump_da(mtk_device *device, uint32_t da_addr, uint16_t *status);
 
 #endif /* MTK_PRELOADER_H */
@@ -0,0 +1,42 @@
+#ifndef MTK_PROGRESS_H
+#define MTK_PROGRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MTK_PROGRESS_DEFAULT_HZ (10)
+
+typedef struct {
+    bool flashing;
+    uint64_t offset;
+    uint64_t total;
+
+    /* Seconds since the transfer started */
+    double elapsed;
+    /* Bytes per second since the previous report, and since the start */
+    double rate;
+    double average_rate;
+    /* Estimated seconds remaining, negative if unknown */
+    double eta;
+} mtk_progress_report;
+
+typedef void (*mtk_progress_fn)(const mtk_progress_report *, void *);
+
+typedef struct {
+    mtk_progress_fn fn;
+    void *user_data;
+    uint64_t interval_ns;
+
+    bool flashing;
+    uint64_t total;
+    uint64_t start_ns;
+    uint64_t last_ns;
+    uint64_t last_offset;
+} mtk_progress;
+
+void mtk_progress_init(mtk_progress *progress, unsigned int rate_hz, mtk_progress_fn fn, void *user_data);
+
+void mtk_progress_begin(mtk_progress *progress, bool flashing, uint64_t total);
+void mtk_progress_update(mtk_progress *progress, uint64_t offset);
+
+#endif /* MTK_PROGRESS_H */
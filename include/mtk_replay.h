@@ -0,0 +1,34 @@
+#ifndef MTK_REPLAY_H
+#define MTK_REPLAY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_device.h"
+
+/*
+ * Plays back the device side of a session captured with mtk_capture. IN
+ * transfers are answered from the capture, and OUT transfers are checked
+ * against it. Replaying requires IN payloads to have been captured in full.
+ */
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+
+    /* Wait for the captured duration of each transfer, instead of completing it immediately */
+    bool original_timing;
+
+    size_t records;
+    /* Set when the host's transfers no longer match the capture */
+    bool diverged;
+} mtk_replay;
+
+extern const mtk_transport mtk_replay_transport;
+
+int mtk_replay_init(mtk_replay *replay, int fd, bool original_timing);
+void mtk_replay_finish(mtk_replay *replay);
+
+#endif /* MTK_REPLAY_H */
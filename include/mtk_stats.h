@@ -0,0 +1,91 @@
+#ifndef MTK_STATS_H
+#define MTK_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Histogram buckets are powers of two in microseconds, the first bucket is below 2 us */
+#define MTK_STATS_BUCKETS (32)
+
+#define MTK_STATS_MAX_PHASES (64)
+
+enum {
+    MTK_STATS_PRELOADER_START,
+    MTK_STATS_PRELOADER_GET_TGT_CONFIG,
+    MTK_STATS_PRELOADER_GET_HW_CODE,
+    MTK_STATS_PRELOADER_GET_HW_SW_VER,
+    MTK_STATS_PRELOADER_WRITE32,
+    MTK_STATS_PRELOADER_SEND_DA,
+    MTK_STATS_PRELOADER_JUMP_DA,
+
+    MTK_STATS_DA_SYNC,
+    MTK_STATS_DA_SEND_DA,
+    MTK_STATS_DA_READ_REPORT,
+    MTK_STATS_DA_USB_CHECK_STATUS,
+    MTK_STATS_DA_USB_SETUP_PORT,
+    MTK_STATS_DA_PROBE,
+    MTK_STATS_DA_SWITCH_PART,
+    MTK_STATS_DA_READ,
+    MTK_STATS_DA_SDMMC_WRITE_DATA,
+    MTK_STATS_DA_FORMAT,
+    MTK_STATS_DA_ENABLE_WATCHDOG,
+
+    MTK_STATS_DA_READ_CHUNK,
+    MTK_STATS_DA_WRITE_CHUNK,
+    MTK_STATS_CHECKSUM,
+    MTK_STATS_HANDLER,
+
+    MTK_STATS_USB_BULK_IN,
+    MTK_STATS_USB_BULK_OUT,
+    MTK_STATS_USB_CONTROL,
+
+    MTK_STATS_TIMERS,
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t buckets[MTK_STATS_BUCKETS];
+} mtk_stats_timer;
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint64_t cpu_ns;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} mtk_stats_phase;
+
+typedef struct {
+    uint64_t start_ns;
+
+    mtk_stats_timer timers[MTK_STATS_TIMERS];
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    /* Chunks reissued after a checksum mismatch or timeout */
+    uint64_t retries;
+
+    mtk_stats_phase phases[MTK_STATS_MAX_PHASES];
+    size_t phases_count;
+    bool phase_active;
+    /* CPU time at the start of the current phase */
+    uint64_t phase_cpu_ns;
+} mtk_stats;
+
+uint64_t mtk_stats_now(void);
+
+void mtk_stats_init(mtk_stats *stats);
+void mtk_stats_record(mtk_stats *stats, unsigned int timer, uint64_t elapsed_ns);
+
+void mtk_stats_phase_begin(mtk_stats *stats, const char *name);
+void mtk_stats_phase_end(mtk_stats *stats);
+
+int mtk_stats_write_json(const mtk_stats *stats, FILE *fp);
+
+#endif /* MTK_STATS_H */
@@ -0,0 +1,122 @@
+#include "mtk_capture.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SETUP_PACKET_SIZE (8)
+
+static int flush_buffer(mtk_capture *capture);
+static void append(mtk_capture *capture, const void *data, size_t len);
+
+uint64_t mtk_fnv1a64(uint64_t hash, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+int mtk_capture_init(mtk_capture *capture, int fd, uint32_t payload_limit) {
+    capture->fd = fd;
+    capture->payload_limit = payload_limit;
+    capture->buffer_used = 0;
+    capture->error = 0;
+
+    if ((capture->buffer = malloc(MTK_CAPTURE_BUFSIZ)) == NULL) {
+        return -errno;
+    }
+
+    mtk_capture_header header = {
+        .version = MTK_CAPTURE_VERSION,
+        .payload_limit = payload_limit,
+    };
+    memcpy(header.magic, MTK_CAPTURE_MAGIC, sizeof(header.magic));
+    append(capture, &header, sizeof(header));
+
+    return 0;
+}
+
+int mtk_capture_finish(mtk_capture *capture) {
+    int err = flush_buffer(capture);
+
+    free(capture->buffer);
+    capture->buffer = NULL;
+
+    return err;
+}
+
+void mtk_capture_transfer(mtk_capture *capture, uint8_t type, uint64_t timestamp_ns, uint64_t duration_ns, int status,
+        const uint8_t *setup, size_t requested, const uint8_t *data, size_t length) {
+    size_t payload_length = length + (setup != NULL ? SETUP_PACKET_SIZE : 0);
+    bool hashed = payload_length > capture->payload_limit;
+
+    mtk_capture_record record = {
+        .timestamp_ns = timestamp_ns,
+        .duration_ns = duration_ns > UINT32_MAX ? UINT32_MAX : duration_ns,
+        .type = type,
+        .flags = hashed ? MTK_CAPTURE_FLAG_HASHED : 0,
+        .status = status,
+        .requested = requested,
+        .length = length,
+    };
+    append(capture, &record, sizeof(record));
+
+    if (hashed) {
+        uint64_t hash = MTK_FNV1A64_INIT;
+        if (setup != NULL) {
+            hash = mtk_fnv1a64(hash, setup, SETUP_PACKET_SIZE);
+        }
+        hash = mtk_fnv1a64(hash, data, length);
+
+        append(capture, &hash, sizeof(hash));
+    } else {
+        if (setup != NULL) {
+            append(capture, setup, SETUP_PACKET_SIZE);
+        }
+        append(capture, data, length);
+    }
+}
+
+static int flush_buffer(mtk_capture *capture) {
+    size_t offset = 0;
+
+    while (capture->error == 0 && offset < capture->buffer_used) {
+        ssize_t n;
+        if ((n = write(capture->fd, capture->buffer + offset, capture->buffer_used - offset)) < 0) {
+            if (errno != EINTR) {
+                capture->error = -errno;
+            }
+            continue;
+        }
+
+        offset += n;
+    }
+
+    capture->buffer_used = 0;
+
+    return capture->error;
+}
+
+static void append(mtk_capture *capture, const void *data, size_t len) {
+    const uint8_t *ptr = data;
+
+    while (len > 0) {
+        if (capture->buffer_used == MTK_CAPTURE_BUFSIZ) {
+            flush_buffer(capture);
+        }
+
+        size_t n = MTK_CAPTURE_BUFSIZ - capture->buffer_used;
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(capture->buffer + capture->buffer_used, ptr, n);
+        capture->buffer_used += n;
+        ptr += n;
+        len -= n;
+    }
+}
@@ -1,15 +1,22 @@
 #include "mtk_da.h"
 
+#include <endian.h>
 #include <errno.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 #include <libusb.h>
 
+#include "probes.h"
+#include "stats.h"
 #include "util.h"
 
-int mtk_da_info_load(int fd, const mtk_da_info **info) {
+#define MTK_DA_SEND_DA_PKTSIZE ((size_t) 0x1000)
+
+int mtk_da_info_load(int fd, const mtk_da_info **info, size_t *size) {
     mtk_da_info tmp_info;
     if (read(fd, &tmp_info, sizeof(tmp_info)) != sizeof(tmp_info)) {
         return -errno;
@@ -33,65 +40,89 @@ int mtk_da_info_load(int fd, const mtk_da_info **info) {
         return -EFBIG;
     }
 
+    /* Map the whole bundle, so that DA stages can be sent straight from it */
     const mtk_da_info *addr_info;
-    if ((addr_info = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    if ((addr_info = mmap(NULL, maxlength, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
         return -errno;
     }
 
     *info = addr_info;
+    *size = maxlength;
+
+    return 0;
+}
+
+int mtk_da_info_region(const mtk_da_info *info, size_t size, const mtk_da_load_region *region, const uint8_t **data) {
+    if (region->offset > size || region->len > size - region->offset) {
+        return -EFBIG;
+    }
+
+    *data = (const uint8_t *) info + region->offset;
 
     return 0;
 }
 
 int mtk_da_sync(mtk_device *device, uint32_t *nand_ret, uint32_t *emmc_ret, uint32_t *emmc_id, uint8_t *da_major_ver, uint8_t *da_minor_ver) {
+    STATS_SCOPE(device, MTK_STATS_DA_SYNC);
+
     int err;
 
     uint8_t sync_char;
     if ((err = mtk_device_read8(device, &sync_char)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if (sync_char != MTK_DA_SYNC_CHAR) {
-        return LIBUSB_ERROR_OTHER;
+        return STATS_RESULT(LIBUSB_ERROR_OTHER);
     }
 
     if ((err = mtk_device_read32(device, nand_ret)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
     uint16_t nand_count;
     if ((err = mtk_device_read16(device, &nand_count)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     for (size_t i = 0; i < nand_count; i++) {
         if ((err = mtk_device_read16(device, NULL)) < 0) {
-            return err;
+            return STATS_RESULT(err);
         }
     }
 
     if ((err = mtk_device_read32(device, emmc_ret)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     for (size_t i = 0; i < 4; i++) {
         if ((err = mtk_device_read32(device, &emmc_id[i])) < 0) {
-            return err;
+            return STATS_RESULT(err);
         }
     }
 
     if ((err = mtk_device_write8(device, MTK_DA_ACK)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
     if ((err = mtk_device_read8(device, da_major_ver)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_read8(device, da_minor_ver)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_read8(device, NULL)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
-    return 0;
+    return STATS_RESULT(0);
+}
+
+uint16_t mtk_da_checksum(const uint8_t *data, size_t len) {
+    uint16_t chksum = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        chksum += data[i];
+    }
+
+    return chksum;
 }
 
 static int send_device_config(mtk_device *device) {
@@ -137,127 +168,242 @@ static int send_device_config(mtk_device *device) {
     return 0;
 }
 
-int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+int mtk_da_send_da(mtk_device *device, uint32_t da_addr, uint32_t da_len, const uint8_t *data, uint8_t *retval) {
+    STATS_SCOPE(device, MTK_STATS_DA_SEND_DA);
+
     int err;
 
     if ((err = send_device_config(device)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
     static const uint8_t name[16] = { 0x46, 0x46 };
     if ((err = mtk_device_write(device, name, sizeof(name))) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_write32(device, 0xff000000)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
     uint32_t data32;
     if ((err = mtk_device_read32(device, &data32)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if (data32 != 0) {
-        return LIBUSB_ERROR_OTHER;
+        return STATS_RESULT(LIBUSB_ERROR_OTHER);
     }
 
-    uint8_t buffer[0x1000];
-
     if ((err = mtk_device_write32(device, da_addr)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_write32(device, da_len)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
-    if ((err = mtk_device_write32(device, sizeof(buffer))) < 0) {
-        return err;
+    if ((err = mtk_device_write32(device, MTK_DA_SEND_DA_PKTSIZE)) < 0) {
+        return STATS_RESULT(err);
     }
 
     if ((err = mtk_device_read8(device, retval)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if (*retval != MTK_DA_ACK) {
-        return 0;
+        return STATS_RESULT(0);
     }
 
+    mtk_progress_begin(device->progress, true, da_len);
+
     size_t offset = 0;
     while (offset < da_len) {
-        size_t count = MIN(sizeof(buffer), da_len - offset);
+        size_t count = MIN(MTK_DA_SEND_DA_PKTSIZE, da_len - offset);
 
-        if ((err = handler(true, offset, da_len, buffer, count, user_data)) < 0) {
-            return err;
-        }
-
-        if ((err = mtk_device_write(device, buffer, count)) < 0) {
-            return err;
+        if ((err = mtk_device_write(device, data + offset, count)) < 0) {
+            return STATS_RESULT(err);
         }
 
         offset += count;
+        mtk_progress_update(device->progress, offset);
 
         if ((err = mtk_device_read8(device, retval)) < 0) {
-            return err;
+            return STATS_RESULT(err);
         }
         if (*retval != MTK_DA_ACK) {
-            return 0;
+            return STATS_RESULT(0);
         }
     }
 
     if ((err = mtk_device_read8(device, retval)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if (*retval != MTK_DA_ACK) {
-        return 0;
+        return STATS_RESULT(0);
     }
 
     if ((err = mtk_device_write8(device, MTK_DA_ACK)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
-    return 0;
+    return STATS_RESULT(0);
+}
+
+static uint32_t report_be32(const uint8_t *report, size_t *offset) {
+    uint32_t value;
+    memcpy(&value, report + *offset, sizeof(value));
+    *offset += sizeof(value);
+    return be32toh(value);
+}
+
+static uint64_t report_be64(const uint8_t *report, size_t *offset) {
+    uint64_t value;
+    memcpy(&value, report + *offset, sizeof(value));
+    *offset += sizeof(value);
+    return be64toh(value);
+}
+
+int mtk_da_read_report(mtk_device *device, mtk_da_emmc_info *emmc, uint8_t *retval) {
+    STATS_SCOPE(device, MTK_STATS_DA_READ_REPORT);
+
+    int err;
+
+    uint8_t report[MTK_DA_FULL_REPORT_SIZE];
+    if ((err = mtk_device_read(device, report, sizeof(report))) < 0) {
+        return STATS_RESULT(err);
+    }
+    if ((err = mtk_device_read8(device, retval)) < 0) {
+        return STATS_RESULT(err);
+    }
+
+    size_t offset = MTK_DA_REPORT_EMMC_OFFSET;
+
+    emmc->ret = report_be32(report, &offset);
+    emmc->boot1_size = report_be64(report, &offset);
+    emmc->boot2_size = report_be64(report, &offset);
+    emmc->rpmb_size = report_be64(report, &offset);
+    for (size_t i = 0; i < MTK_DA_EMMC_GP_PARTS; i++) {
+        emmc->gp_size[i] = report_be64(report, &offset);
+    }
+    emmc->ua_size = report_be64(report, &offset);
+    for (size_t i = 0; i < 4; i++) {
+        emmc->cid[i] = report_be32(report, &offset);
+    }
+    memcpy(emmc->fwver, report + offset, sizeof(emmc->fwver));
+
+    return STATS_RESULT(0);
 }
 
 int mtk_da_usb_check_status(mtk_device *device, uint8_t *usb_status, uint8_t *retval) {
+    STATS_SCOPE(device, MTK_STATS_DA_USB_CHECK_STATUS);
+
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_USB_CHECK_STATUS_CMD)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
     if ((err = mtk_device_read8(device, retval)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
 
     if (*retval == MTK_DA_ACK) {
         if ((err = mtk_device_read8(device, usb_status)) < 0) {
-            return err;
+            return STATS_RESULT(err);
         }
     }
 
-    return 0;
+    return STATS_RESULT(0);
+}
+
+int mtk_da_usb_setup_port(mtk_device *device, uint8_t speed, uint8_t *retval) {
+    STATS_SCOPE(device, MTK_STATS_DA_USB_SETUP_PORT);
+
+    int err;
+
+    if ((err = mtk_device_write8(device, MTK_DA_USB_SETUP_PORT_CMD)) < 0) {
+        return STATS_RESULT(err);
+    }
+    if ((err = mtk_device_write8(device, speed)) < 0) {
+        return STATS_RESULT(err);
+    }
+
+    return STATS_RESULT(mtk_device_read8(device, retval));
+}
+
+int mtk_da_probe(mtk_device *device, bool *running) {
+    STATS_SCOPE(device, MTK_STATS_DA_PROBE);
+
+    int err;
+
+    *running = false;
+
+    /* Left over from an earlier session, and would be taken as the reply */
+    if ((err = mtk_device_discard(device)) < 0) {
+        return STATS_RESULT(err);
+    }
+
+    /*
+     * Ignored by a Preloader that has not been sent the start sequence yet.
+     * One that has would take the byte as a command, so the caller must know
+     * that the device is in one of the two states.
+     */
+    if ((err = mtk_device_write8(device, MTK_DA_USB_CHECK_STATUS_CMD)) < 0) {
+        return STATS_RESULT(err == LIBUSB_ERROR_TIMEOUT ? 0 : err);
+    }
+
+    uint8_t reply[2];
+    if ((err = mtk_device_read_timeout(device, reply, sizeof(reply), MTK_DA_PROBE_TMOUT)) < 0 && err != LIBUSB_ERROR_TIMEOUT) {
+        return STATS_RESULT(err);
+    }
+
+    *running = (err == 0 && reply[0] == MTK_DA_ACK && reply[1] <= MTK_DA_USB_HIGH_SPEED);
+
+    if (!*running) {
+        /* Drop a partial or unexpected reply before syncing with the Preloader */
+        return STATS_RESULT(mtk_device_discard(device));
+    }
+
+    return STATS_RESULT(0);
 }
 
 int mtk_da_sdmmc_switch_part(mtk_device *device, uint8_t part, uint8_t *retval) {
+    STATS_SCOPE(device, MTK_STATS_DA_SWITCH_PART);
+
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_SWITCH_PART_CMD)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_read8(device, retval)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if (*retval == MTK_DA_ACK) {
         if ((err = mtk_device_write8(device, part)) < 0) {
-            return err;
+            return STATS_RESULT(err);
         }
 
         if ((err = mtk_device_read8(device, retval)) < 0) {
-            return err;
+            return STATS_RESULT(err);
         }
     }
 
-    return 0;
+    return STATS_RESULT(0);
 }
 
-int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+/* Drains the rest of a stalled chunk and its checksum, then rejects it once the DA waits for the ACK */
+static int reject_chunk(mtk_device *device, int err, bool *retry) {
+    if (err != LIBUSB_ERROR_TIMEOUT) {
+        return err;
+    }
+    if ((err = mtk_device_discard(device)) < 0) {
+        return err;
+    }
+    if ((err = mtk_device_write8(device, MTK_DA_NACK)) < 0) {
+        return err;
+    }
+
+    *retry = true;
+    return LIBUSB_ERROR_TIMEOUT;
+}
+
+static int read_range(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, size_t *offset, uint8_t *retval, bool *retry, const mtk_io_handler handler, void *user_data) {
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_READ_CMD)) < 0) {
@@ -269,10 +415,10 @@ int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t
     if ((err = mtk_device_write8(device, hw_storage)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, addr)) < 0) {
+    if ((err = mtk_device_write64(device, addr + *offset)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, len)) < 0) {
+    if ((err = mtk_device_write64(device, len - *offset)) < 0) {
         return err;
     }
 
@@ -283,30 +429,42 @@ int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t
         return 0;
     }
 
-    uint8_t buffer[0x100000];
+    uint8_t buffer[MTK_DA_CHUNK_SIZE];
     if ((err = mtk_device_write32(device, sizeof(buffer))) < 0) {
         return err;
     }
 
-    size_t offset = 0;
-    while (offset < len) {
-        size_t count = MIN(sizeof(buffer), len - offset);
+    if (*offset == 0) {
+        mtk_progress_begin(device->progress, false, len);
+    }
 
-        if ((err = mtk_device_read(device, buffer, count)) < 0) {
-            return err;
-        }
+    while (*offset < len) {
+        size_t count = MIN(sizeof(buffer), len - *offset);
 
-        uint16_t chksum = 0;
-        for (size_t i = 0; i < count; i++) {
-            chksum += buffer[i];
+        PROBE2(read__chunk__start, addr + *offset, count);
+        STATS_TIME(device, MTK_STATS_DA_READ_CHUNK, err = mtk_device_read(device, buffer, count));
+        PROBE3(read__chunk__end, addr + *offset, count, err);
+        if (err < 0) {
+            return reject_chunk(device, err, retry);
         }
 
+        PROBE2(checksum__start, addr + *offset, count);
+
+        uint16_t chksum;
+        STATS_TIME(device, MTK_STATS_CHECKSUM, chksum = mtk_da_checksum(buffer, count));
+
         uint16_t chksum_device;
         if ((err = mtk_device_read16(device, &chksum_device)) < 0) {
-            return err;
+            return reject_chunk(device, err, retry);
         }
 
+        PROBE3(checksum__end, addr + *offset, count, chksum == chksum_device);
         if (chksum != chksum_device) {
+            /* The whole chunk arrived, reject it so the DA ends the transfer */
+            if ((err = mtk_device_write8(device, MTK_DA_NACK)) < 0) {
+                return err;
+            }
+            *retry = true;
             return LIBUSB_ERROR_OTHER;
         }
 
@@ -314,17 +472,62 @@ int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t
             return err;
         }
 
-        if ((err = handler(false, offset, len, buffer, count, user_data)) < 0) {
+        PROBE2(handler__start, addr + *offset, count);
+        STATS_TIME(device, MTK_STATS_HANDLER, err = handler(false, *offset, len, buffer, count, user_data));
+        PROBE3(handler__end, addr + *offset, count, err);
+        if (err < 0) {
             return err;
         }
 
-        offset += count;
+        *offset += count;
+        mtk_progress_update(device->progress, *offset);
     }
 
     return 0;
 }
 
-int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+static int read_retrying(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    size_t offset = 0;
+    unsigned int retries = 0;
+
+    while (true) {
+        size_t start = offset;
+        bool retry = false;
+
+        int err = read_range(device, hw_storage, addr, len, &offset, retval, &retry, handler, user_data);
+        if (!retry) {
+            return err;
+        }
+
+        /* Retries are bounded per chunk, reissue the read from the chunk that was rejected or timed out */
+        if (offset != start) {
+            retries = 0;
+        }
+        if (retries++ == MTK_DA_MAX_RETRIES) {
+            return err;
+        }
+
+        PROBE3(retry, addr + offset, retries, err);
+        stats_add_retry(device->stats);
+
+        /* Drop anything the DA sent after the rejected chunk before reissuing the command */
+        if ((err = mtk_device_discard(device)) < 0) {
+            return err;
+        }
+    }
+}
+
+int mtk_da_read(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    STATS_SCOPE(device, MTK_STATS_DA_READ);
+
+    PROBE2(read__start, addr, len);
+    int err = read_retrying(device, hw_storage, addr, len, retval, handler, user_data);
+    PROBE3(read__end, addr, len, err);
+
+    return STATS_RESULT(err);
+}
+
+static int write_range(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint64_t end, size_t *offset, uint8_t *buffer, size_t *buffered, uint8_t *retval, bool *retry, const mtk_io_handler handler, void *user_data) {
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_SDMMC_WRITE_DATA_CMD)) < 0) {
@@ -336,15 +539,14 @@ int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t pa
     if ((err = mtk_device_write8(device, part)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, addr)) < 0) {
+    if ((err = mtk_device_write64(device, addr + *offset)) < 0) {
         return err;
     }
-    if ((err = mtk_device_write64(device, len)) < 0) {
+    if ((err = mtk_device_write64(device, end - *offset)) < 0) {
         return err;
     }
 
-    uint8_t buffer[0x100000];
-    if ((err = mtk_device_write32(device, sizeof(buffer))) < 0) {
+    if ((err = mtk_device_write32(device, MTK_DA_CHUNK_SIZE)) < 0) {
         return err;
     }
 
@@ -355,26 +557,39 @@ int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t pa
         return 0;
     }
 
-    size_t offset = 0;
-    while (offset < len) {
+    if (*offset == 0) {
+        mtk_progress_begin(device->progress, true, len);
+    }
+
+    while (*offset < end) {
         if ((err = mtk_device_write8(device, MTK_DA_ACK)) < 0) {
-            return 0;
+            return err;
         }
 
-        size_t count = MIN(sizeof(buffer), len - offset);
-
-        if ((err = handler(true, offset, len, buffer, count, user_data)) < 0) {
-            return err;
+        size_t count = MIN((uint64_t) MTK_DA_CHUNK_SIZE, end - *offset);
+
+        /* A retried chunk is sent again from the buffer, so handlers see every offset once */
+        if (*buffered != *offset) {
+            PROBE2(handler__start, addr + *offset, count);
+            STATS_TIME(device, MTK_STATS_HANDLER, err = handler(true, *offset, len, buffer, count, user_data));
+            PROBE3(handler__end, addr + *offset, count, err);
+            if (err < 0) {
+                return err;
+            }
+            *buffered = *offset;
         }
 
-        if ((err = mtk_device_write(device, buffer, count)) < 0) {
+        PROBE2(write__chunk__start, addr + *offset, count);
+        STATS_TIME(device, MTK_STATS_DA_WRITE_CHUNK, err = mtk_device_write(device, buffer, count));
+        PROBE3(write__chunk__end, addr + *offset, count, err);
+        if (err < 0) {
             return err;
         }
 
-        uint16_t chksum = 0;
-        for (size_t i = 0; i < count; i++) {
-            chksum += buffer[i];
-        }
+        PROBE2(checksum__start, addr + *offset, count);
+
+        uint16_t chksum;
+        STATS_TIME(device, MTK_STATS_CHECKSUM, chksum = mtk_da_checksum(buffer, count));
 
         if ((err = mtk_device_write16(device, chksum)) < 0) {
             return err;
@@ -383,40 +598,175 @@ int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t pa
         if ((err = mtk_device_read8(device, retval)) < 0) {
             return err;
         }
+
+        /* The DA answers CONT_CHAR once the checksum matched */
+        PROBE3(checksum__end, addr + *offset, count, *retval == MTK_DA_CONT_CHAR);
         if (*retval != MTK_DA_CONT_CHAR) {
+            /* DA rejects a whole chunk that fails its checksum, and ends the transfer */
+            *retry = (*retval == MTK_DA_NACK);
             return 0;
         }
 
-        offset += count;
+        *offset += count;
+        mtk_progress_update(device->progress, *offset);
     }
 
     return 0;
 }
 
+static int write_segment(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint64_t end, size_t *offset, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    uint8_t buffer[MTK_DA_CHUNK_SIZE];
+    size_t buffered = SIZE_MAX;
+    unsigned int retries = 0;
+
+    while (true) {
+        size_t start = *offset;
+        bool retry = false;
+
+        int err = write_range(device, storage_type, part, addr, len, end, offset, buffer, &buffered, retval, &retry, handler, user_data);
+        if (!retry) {
+            return err;
+        }
+
+        if (*offset != start) {
+            retries = 0;
+        }
+        if (retries++ == MTK_DA_MAX_RETRIES) {
+            return err;
+        }
+
+        PROBE3(retry, addr + *offset, retries, err);
+        stats_add_retry(device->stats);
+
+        /* Drop anything the DA sent after the rejected chunk before reissuing the command */
+        if ((err = mtk_device_discard(device)) < 0) {
+            return err;
+        }
+    }
+}
+
+int mtk_da_sdmmc_write_data(mtk_device *device, uint8_t storage_type, uint8_t part, uint64_t addr, uint64_t len, uint64_t erase_group, uint8_t *retval, const mtk_io_handler handler, void *user_data) {
+    STATS_SCOPE(device, MTK_STATS_DA_SDMMC_WRITE_DATA);
+
+    /*
+     * Partial erase groups at the head and tail are written by their own
+     * commands. The erase group either divides the chunk size or is a
+     * multiple of it, so chunks in between never straddle a group boundary
+     * and the EMMC does not have to read-modify-write them.
+     */
+    if (erase_group != 0 && MTK_DA_CHUNK_SIZE % erase_group != 0 && erase_group % MTK_DA_CHUNK_SIZE != 0) {
+        return STATS_RESULT(LIBUSB_ERROR_INVALID_PARAM);
+    }
+
+    uint64_t ends[] = { len, len, len };
+    if (erase_group != 0) {
+        uint64_t head = (erase_group - addr % erase_group) % erase_group;
+        if (head < len) {
+            ends[0] = head;
+            ends[1] = head + (len - head) / erase_group * erase_group;
+        }
+    }
+
+    PROBE2(write__start, addr, len);
+
+    size_t offset = 0;
+    int err = 0;
+
+    for (size_t i = 0; i < sizeof(ends) / sizeof(*ends); i++) {
+        if (offset == ends[i]) {
+            continue;
+        }
+
+        err = write_segment(device, storage_type, part, addr, len, ends[i], &offset, retval, handler, user_data);
+        if (err < 0 || offset < ends[i]) {
+            break;
+        }
+    }
+
+    PROBE3(write__end, addr, len, err);
+
+    return STATS_RESULT(err);
+}
+
+int mtk_da_format(mtk_device *device, uint8_t hw_storage, uint64_t addr, uint64_t len, uint8_t *retval) {
+    STATS_SCOPE(device, MTK_STATS_DA_FORMAT);
+
+    int err;
+
+    if ((err = mtk_device_write8(device, MTK_DA_FORMAT_CMD)) < 0) {
+        return STATS_RESULT(err);
+    }
+
+    /*
+     * The parameters are only sent once the DA has accepted the command, a DA
+     * without it would take them as commands of their own.
+     */
+    if ((err = mtk_device_read_timeout(device, retval, sizeof(*retval), MTK_DA_PROBE_TMOUT)) < 0 && err != LIBUSB_ERROR_TIMEOUT) {
+        return STATS_RESULT(err);
+    }
+    if (err < 0 || *retval != MTK_DA_ACK) {
+        /* Unsupported, leave the DA ready for the writes that replace the erase */
+        *retval = MTK_DA_NACK;
+        return STATS_RESULT(mtk_device_discard(device));
+    }
+
+    if ((err = mtk_device_write8(device, hw_storage)) < 0) {
+        return STATS_RESULT(err);
+    }
+    if ((err = mtk_device_write64(device, addr)) < 0) {
+        return STATS_RESULT(err);
+    }
+    if ((err = mtk_device_write64(device, len)) < 0) {
+        return STATS_RESULT(err);
+    }
+
+    if ((err = mtk_device_read8(device, retval)) < 0) {
+        return STATS_RESULT(err);
+    }
+    if (*retval != MTK_DA_ACK) {
+        /* The range was rejected, the writes that replace the erase can follow */
+        return STATS_RESULT(0);
+    }
+
+    uint8_t progress = 0;
+    while (progress < 100) {
+        if ((err = mtk_device_read_timeout(device, &progress, sizeof(progress), MTK_DA_FORMAT_TMOUT)) < 0) {
+            return STATS_RESULT(err);
+        }
+        if ((err = mtk_device_write8(device, MTK_DA_ACK)) < 0) {
+            return STATS_RESULT(err);
+        }
+    }
+
+    return STATS_RESULT(mtk_device_read8(device, retval));
+}
+
 int mtk_da_enable_watchdog(mtk_device *device, uint16_t timeout_ms, bool async, bool bootup, bool dlbit, bool not_reset_rtc_time, uint8_t *retval) {
+    STATS_SCOPE(device, MTK_STATS_DA_ENABLE_WATCHDOG);
+
     int err;
 
     if ((err = mtk_device_write8(device, MTK_DA_ENABLE_WATCHDOG_CMD)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_write32(device, timeout_ms)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_write8(device, async)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_write8(device, bootup)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_write8(device, dlbit)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_write8(device, not_reset_rtc_time)) < 0) {
-        return err;
+        return STATS_RESULT(err);
     }
     if ((err = mtk_device_read8(device, retval))) {
-        return err;
+        return STATS_RESULT(err);
     }
 
-    return 0;
+    return STATS_RESULT(0);
 }
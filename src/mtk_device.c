@@ -3,15 +3,27 @@
 #include <endian.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/time.h>
 
 #include <libusb.h>
 
+#include "stats.h"
 #include "util.h"
 
-int mtk_device_open(mtk_device *device, libusb_device_handle *dev) {
-    device->dev = dev;
+static void init_device(mtk_device *device) {
+    device->dev = NULL;
+    device->transport = NULL;
+    device->transport_ctx = NULL;
     device->buffer_offset = 0;
     device->buffer_available = 0;
+    device->progress = NULL;
+    device->stats = NULL;
+    device->capture = NULL;
+}
+
+int mtk_device_open(mtk_device *device, libusb_device_handle *dev) {
+    init_device(device);
+    device->dev = dev;
 
     int err;
 
@@ -30,19 +42,70 @@ int mtk_device_open(mtk_device *device, libusb_device_handle *dev) {
     return 0;
 }
 
+void mtk_device_open_transport(mtk_device *device, const mtk_transport *transport, void *ctx) {
+    init_device(device);
+    device->transport = transport;
+    device->transport_ctx = ctx;
+}
+
+typedef struct {
+    libusb_device *dev;
+    int completed;
+    /* Device that is about to leave the bus, while waiting for it to come back */
+    libusb_device *ignore;
+} hotplug_state;
+
 static int hotplug_callback_fn(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data) {
     (void) ctx;
     (void) event;
 
-    libusb_device **dev = user_data;
-    *dev = device;
+    hotplug_state *state = user_data;
+    if (device == state->ignore) {
+        return false;
+    }
+    if (state->dev == NULL) {
+        /* Keep the device alive after the callback returns */
+        state->dev = libusb_ref_device(device);
+        state->completed = true;
+    }
 
+    /* Deregister, only the first device is used */
     return true;
 }
 
-int mtk_device_detect(mtk_device *device, libusb_context *ctx) {
-    libusb_device *dev = NULL;
+static int wait_hotplug(libusb_context *ctx, hotplug_state *state, unsigned int timeout) {
+    if (timeout == 0) {
+        return libusb_handle_events_completed(ctx, &state->completed);
+    }
+
+    uint64_t deadline = mtk_stats_now() + (uint64_t) timeout * 1000000;
+
+    while (!state->completed) {
+        uint64_t now = mtk_stats_now();
+        if (now >= deadline) {
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+
+        uint64_t remaining = MIN(deadline - now, (uint64_t) MTK_DEVICE_DETECT_POLL_TMOUT * 1000000);
+        struct timeval tv = {
+            .tv_sec = remaining / 1000000000,
+            .tv_usec = (remaining % 1000000000) / 1000,
+        };
 
+        int err = libusb_handle_events_timeout_completed(ctx, &tv, &state->completed);
+        if (err < 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+static int detect(mtk_device *device, libusb_context *ctx, unsigned int timeout, libusb_device *ignore) {
+    hotplug_state state = { .dev = NULL, .completed = false, .ignore = ignore };
+    libusb_hotplug_callback_handle handle;
+
+    /* A device that is already attached is reported from within the registration */
     int err = libusb_hotplug_register_callback(ctx,
         LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
         LIBUSB_HOTPLUG_ENUMERATE,
@@ -50,34 +113,156 @@ int mtk_device_detect(mtk_device *device, libusb_context *ctx) {
         MTK_DEVICE_PID,
         LIBUSB_CLASS_COMM,
         hotplug_callback_fn,
-        &dev,
-        NULL);
+        &state,
+        &handle);
 
     if (err < 0) {
         return err;
     }
 
-    while (dev == NULL) {
-        libusb_handle_events(ctx);
+    while (!state.completed) {
+        if ((err = wait_hotplug(ctx, &state, timeout)) < 0) {
+            break;
+        }
+    }
+
+    /*
+     * A return value of true from a callback run within the registration is
+     * ignored, so the callback must always be removed here, before state goes
+     * out of scope. Removing a callback that already deregistered is a no-op.
+     */
+    libusb_hotplug_deregister_callback(ctx, handle);
+
+    if (!state.completed) {
+        return err;
     }
 
     libusb_device_handle *devh;
-    if ((err = libusb_open(dev, &devh)) < 0) {
+    err = libusb_open(state.dev, &devh);
+    libusb_unref_device(state.dev);
+    if (err < 0) {
         return err;
     }
 
     return mtk_device_open(device, devh);
 }
 
+int mtk_device_detect(mtk_device *device, libusb_context *ctx, unsigned int timeout) {
+    return detect(device, ctx, timeout, NULL);
+}
+
+int mtk_device_reattach(mtk_device *device, libusb_context *ctx, unsigned int timeout) {
+    if (device->transport != NULL) {
+        return 0;
+    }
+
+    mtk_progress *progress = device->progress;
+    mtk_stats *stats = device->stats;
+    mtk_capture *capture = device->capture;
+
+    /* Keep a reference, so the address cannot be reused by the device that comes back */
+    libusb_device *old = libusb_ref_device(libusb_get_device(device->dev));
+    mtk_device_close(device);
+
+    int err = detect(device, ctx, timeout, old);
+    libusb_unref_device(old);
+
+    device->progress = progress;
+    device->stats = stats;
+    device->capture = capture;
+
+    return err;
+}
+
+void mtk_device_close(mtk_device *device) {
+    if (device->dev != NULL) {
+        libusb_release_interface(device->dev, MTK_DEVICE_INTERFACE);
+        libusb_close(device->dev);
+        device->dev = NULL;
+    }
+}
+
+int mtk_device_speed(const mtk_device *device) {
+    if (device->dev == NULL) {
+        return LIBUSB_SPEED_UNKNOWN;
+    }
+    return libusb_get_device_speed(libusb_get_device(device->dev));
+}
+
+static int do_bulk_transfer(mtk_device *device, uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout) {
+    if (device->transport != NULL) {
+        return device->transport->bulk_transfer(device->transport_ctx, endpoint, data, length, transferred, timeout);
+    }
+    return libusb_bulk_transfer(device->dev, endpoint, data, length, transferred, timeout);
+}
+
+static int do_control_transfer(mtk_device *device, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout) {
+    if (device->transport != NULL) {
+        return device->transport->control_transfer(device->transport_ctx, request_type, request, value, index, data, length, timeout);
+    }
+    return libusb_control_transfer(device->dev, request_type, request, value, index, data, length, timeout);
+}
+
+static int bulk_transfer(mtk_device *device, uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout) {
+    if (device->stats == NULL && device->capture == NULL) {
+        return do_bulk_transfer(device, endpoint, data, length, transferred, timeout);
+    }
+
+    uint64_t start = mtk_stats_now();
+    int err = do_bulk_transfer(device, endpoint, data, length, transferred, timeout);
+    uint64_t elapsed = mtk_stats_now() - start;
+
+    bool in = (endpoint & LIBUSB_ENDPOINT_IN);
+
+    if (device->stats != NULL) {
+        mtk_stats_record(device->stats, in ? MTK_STATS_USB_BULK_IN : MTK_STATS_USB_BULK_OUT, elapsed);
+        stats_add_bytes(device->stats, in ? *transferred : 0, in ? 0 : *transferred);
+    }
+    if (device->capture != NULL) {
+        mtk_capture_transfer(device->capture, in ? MTK_CAPTURE_BULK_IN : MTK_CAPTURE_BULK_OUT, start, elapsed, err, NULL, length, data, *transferred);
+    }
+
+    return err;
+}
+
+int mtk_device_control_transfer(mtk_device *device, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout) {
+    if (device->stats == NULL && device->capture == NULL) {
+        return do_control_transfer(device, request_type, request, value, index, data, length, timeout);
+    }
+
+    uint64_t start = mtk_stats_now();
+    int err = do_control_transfer(device, request_type, request, value, index, data, length, timeout);
+    uint64_t elapsed = mtk_stats_now() - start;
+
+    if (device->stats != NULL) {
+        mtk_stats_record(device->stats, MTK_STATS_USB_CONTROL, elapsed);
+    }
+    if (device->capture != NULL) {
+        const uint8_t setup[8] = {
+            request_type, request,
+            value & 0xff, value >> 8,
+            index & 0xff, index >> 8,
+            length & 0xff, length >> 8,
+        };
+        mtk_capture_transfer(device->capture, MTK_CAPTURE_CONTROL, start, elapsed, err, setup, length, data, err > 0 ? err : 0);
+    }
+
+    return err;
+}
+
 int mtk_device_read(mtk_device *device, uint8_t *buffer, size_t size) {
+    return mtk_device_read_timeout(device, buffer, size, MTK_DEVICE_TMOUT);
+}
+
+int mtk_device_read_timeout(mtk_device *device, uint8_t *buffer, size_t size, unsigned int timeout) {
     size_t offset = 0;
 
     while (offset < size) {
         if (device->buffer_available == 0) {
-            int transferred;
+            int transferred = 0;
 
             int err;
-            if ((err = libusb_bulk_transfer(device->dev, MTK_DEVICE_EPIN, device->buffer, MTK_DEVICE_PKTSIZE, &transferred, MTK_DEVICE_TMOUT)) < 0) {
+            if ((err = bulk_transfer(device, MTK_DEVICE_EPIN, device->buffer, MTK_DEVICE_PKTSIZE, &transferred, timeout)) < 0) {
                 return err;
             }
 
@@ -102,10 +287,11 @@ int mtk_device_write(mtk_device *device, const uint8_t *buffer, size_t size) {
     size_t offset = 0;
 
     while (offset < size) {
-        int transferred;
+        int transferred = 0;
 
-        int err = libusb_bulk_transfer(device->dev, MTK_DEVICE_EPOUT, (uint8_t *) buffer + offset, size - offset, &transferred, MTK_DEVICE_TMOUT);
-        if (err < 0) {
+        int err = bulk_transfer(device, MTK_DEVICE_EPOUT, (uint8_t *) buffer + offset, size - offset, &transferred, MTK_DEVICE_TMOUT);
+        /* Large transfers may time out part way through, only give up if nothing was sent */
+        if (err < 0 && !(err == LIBUSB_ERROR_TIMEOUT && transferred > 0)) {
             return err;
         }
 
@@ -115,6 +301,22 @@ int mtk_device_write(mtk_device *device, const uint8_t *buffer, size_t size) {
     return 0;
 }
 
+int mtk_device_discard(mtk_device *device) {
+    mtk_device_flush_buffer(device);
+
+    while (true) {
+        int transferred = 0;
+
+        int err = bulk_transfer(device, MTK_DEVICE_EPIN, device->buffer, MTK_DEVICE_PKTSIZE, &transferred, MTK_DEVICE_DISCARD_TMOUT);
+        if (err == LIBUSB_ERROR_TIMEOUT || (err == 0 && transferred == 0)) {
+            return 0;
+        }
+        if (err < 0) {
+            return err;
+        }
+    }
+}
+
 int mtk_device_read8(mtk_device *device, uint8_t *data) {
     return mtk_device_read(device, data, sizeof(*data));
 }
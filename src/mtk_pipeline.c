@@ -0,0 +1,222 @@
+#include "mtk_pipeline.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *stage_worker(void *arg);
+static void release_chunk(mtk_pipeline *pipeline, mtk_pipeline_chunk *chunk);
+
+int mtk_pipeline_init(mtk_pipeline *pipeline, size_t depth) {
+    memset(pipeline, 0, sizeof(*pipeline));
+
+    if (depth == 0) {
+        depth = MTK_PIPELINE_DEFAULT_DEPTH;
+    }
+
+    if ((pipeline->chunks = calloc(depth, sizeof(*pipeline->chunks))) == NULL) {
+        return -errno;
+    }
+    if ((pipeline->free_chunks = calloc(depth, sizeof(*pipeline->free_chunks))) == NULL) {
+        int err = -errno;
+        free(pipeline->chunks);
+        return err;
+    }
+
+    /* Buffers are allocated on first use, sized to the chunks the transfer hands over */
+    pipeline->depth = depth;
+    for (size_t i = 0; i < depth; i++) {
+        pipeline->free_chunks[i] = &pipeline->chunks[i];
+    }
+    pipeline->free_count = depth;
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->freed, NULL);
+
+    return 0;
+}
+
+int mtk_pipeline_add_stage(mtk_pipeline *pipeline, mtk_io_handler handler, void *user_data, bool threaded) {
+    if (pipeline->stages_count == MTK_PIPELINE_MAX_STAGES) {
+        return -ENOSPC;
+    }
+
+    mtk_pipeline_stage *stage = &pipeline->stages[pipeline->stages_count];
+    memset(stage, 0, sizeof(*stage));
+
+    stage->pipeline = pipeline;
+    stage->handler = handler;
+    stage->user_data = user_data;
+    stage->threaded = threaded;
+
+    if (threaded) {
+        if ((stage->queue = calloc(pipeline->depth, sizeof(*stage->queue))) == NULL) {
+            return -errno;
+        }
+
+        pthread_cond_init(&stage->queued, NULL);
+
+        int err;
+        if ((err = pthread_create(&stage->thread, NULL, stage_worker, stage)) != 0) {
+            pthread_cond_destroy(&stage->queued);
+            free(stage->queue);
+            return -err;
+        }
+
+        pipeline->threaded_count++;
+    }
+
+    pipeline->stages_count++;
+
+    return 0;
+}
+
+int mtk_pipeline_finish(mtk_pipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->done = true;
+    for (size_t i = 0; i < pipeline->stages_count; i++) {
+        if (pipeline->stages[i].threaded) {
+            pthread_cond_signal(&pipeline->stages[i].queued);
+        }
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    for (size_t i = 0; i < pipeline->stages_count; i++) {
+        mtk_pipeline_stage *stage = &pipeline->stages[i];
+        if (stage->threaded) {
+            pthread_join(stage->thread, NULL);
+            pthread_cond_destroy(&stage->queued);
+            free(stage->queue);
+        }
+    }
+
+    for (size_t i = 0; i < pipeline->depth; i++) {
+        free(pipeline->chunks[i].data);
+    }
+    free(pipeline->free_chunks);
+    free(pipeline->chunks);
+
+    pthread_cond_destroy(&pipeline->freed);
+    pthread_mutex_destroy(&pipeline->lock);
+
+    return pipeline->error;
+}
+
+int mtk_pipeline_handler(bool flashing, size_t offset, size_t total_length, uint8_t *buffer, size_t count, void *user_data) {
+    mtk_pipeline *pipeline = user_data;
+
+    int err;
+
+    for (size_t i = 0; i < pipeline->stages_count; i++) {
+        mtk_pipeline_stage *stage = &pipeline->stages[i];
+        if (!stage->threaded && (err = stage->handler(flashing, offset, total_length, buffer, count, stage->user_data)) < 0) {
+            pthread_mutex_lock(&pipeline->lock);
+            if (pipeline->error == 0) {
+                pipeline->error = err;
+            }
+            pthread_mutex_unlock(&pipeline->lock);
+            return err;
+        }
+    }
+
+    if (pipeline->threaded_count == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->free_count == 0 && pipeline->error == 0) {
+        /* Every buffer is in flight, a threaded stage is slower than the transfer */
+        pthread_cond_wait(&pipeline->freed, &pipeline->lock);
+    }
+    if ((err = pipeline->error) < 0) {
+        pthread_mutex_unlock(&pipeline->lock);
+        return err;
+    }
+    mtk_pipeline_chunk *chunk = pipeline->free_chunks[--pipeline->free_count];
+    pthread_mutex_unlock(&pipeline->lock);
+
+    /* The chunk is not shared until it is queued, so it is filled without holding the lock */
+    if (count > chunk->capacity) {
+        uint8_t *data;
+        if ((data = realloc(chunk->data, count)) == NULL) {
+            err = -errno;
+            pthread_mutex_lock(&pipeline->lock);
+            pipeline->free_chunks[pipeline->free_count++] = chunk;
+            pthread_mutex_unlock(&pipeline->lock);
+            return err;
+        }
+        chunk->data = data;
+        chunk->capacity = count;
+    }
+
+    memcpy(chunk->data, buffer, count);
+    chunk->flashing = flashing;
+    chunk->offset = offset;
+    chunk->total_length = total_length;
+    chunk->count = count;
+    chunk->refs = pipeline->threaded_count;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (size_t i = 0; i < pipeline->stages_count; i++) {
+        mtk_pipeline_stage *stage = &pipeline->stages[i];
+        if (stage->threaded) {
+            stage->queue[(stage->queue_head + stage->queue_count++) % pipeline->depth] = chunk;
+            pthread_cond_signal(&stage->queued);
+        }
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return 0;
+}
+
+static void *stage_worker(void *arg) {
+    mtk_pipeline_stage *stage = arg;
+    mtk_pipeline *pipeline = stage->pipeline;
+
+    pthread_mutex_lock(&pipeline->lock);
+
+    while (true) {
+        if (stage->queue_count == 0) {
+            /* Queued chunks are drained before the stage exits */
+            if (pipeline->done) {
+                break;
+            }
+            pthread_cond_wait(&stage->queued, &pipeline->lock);
+            continue;
+        }
+
+        mtk_pipeline_chunk *chunk = stage->queue[stage->queue_head];
+        stage->queue_head = (stage->queue_head + 1) % pipeline->depth;
+        stage->queue_count--;
+
+        bool failed = stage->failed;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int err = 0;
+        if (!failed) {
+            err = stage->handler(chunk->flashing, chunk->offset, chunk->total_length, chunk->data, chunk->count, stage->user_data);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (err < 0) {
+            stage->failed = true;
+            if (pipeline->error == 0) {
+                pipeline->error = err;
+            }
+            /* Wake the transfer if it is waiting for a buffer, so it can fail */
+            pthread_cond_signal(&pipeline->freed);
+        }
+        release_chunk(pipeline, chunk);
+    }
+
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+static void release_chunk(mtk_pipeline *pipeline, mtk_pipeline_chunk *chunk) {
+    if (--chunk->refs == 0) {
+        pipeline->free_chunks[pipeline->free_count++] = chunk;
+        pthread_cond_signal(&pipeline->freed);
+    }
+}
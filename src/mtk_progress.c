@@ -0,0 +1,72 @@
+#include "mtk_progress.h"
+
+#include <stddef.h>
+#include <time.h>
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void mtk_progress_init(mtk_progress *progress, unsigned int rate_hz, mtk_progress_fn fn, void *user_data) {
+    progress->fn = fn;
+    progress->user_data = user_data;
+    progress->interval_ns = rate_hz > 0 ? 1000000000 / rate_hz : 0;
+
+    progress->flashing = false;
+    progress->total = 0;
+    progress->start_ns = 0;
+    progress->last_ns = 0;
+    progress->last_offset = 0;
+}
+
+void mtk_progress_begin(mtk_progress *progress, bool flashing, uint64_t total) {
+    if (progress == NULL) {
+        return;
+    }
+
+    progress->flashing = flashing;
+    progress->total = total;
+    progress->start_ns = now_ns();
+    progress->last_ns = progress->start_ns;
+    progress->last_offset = 0;
+}
+
+void mtk_progress_update(mtk_progress *progress, uint64_t offset) {
+    if (progress == NULL) {
+        return;
+    }
+
+    uint64_t now = now_ns();
+    bool done = (offset >= progress->total);
+
+    /* Always report completion, otherwise at most once per interval */
+    if (!done && now - progress->last_ns < progress->interval_ns) {
+        return;
+    }
+
+    double elapsed = (now - progress->start_ns) / 1e9;
+    double interval = (now - progress->last_ns) / 1e9;
+
+    mtk_progress_report report = {
+        .flashing = progress->flashing,
+        .offset = offset,
+        .total = progress->total,
+        .elapsed = elapsed,
+        .rate = interval > 0 ? (offset - progress->last_offset) / interval : 0,
+        .average_rate = elapsed > 0 ? offset / elapsed : 0,
+        .eta = -1,
+    };
+
+    if (done) {
+        report.eta = 0;
+    } else if (report.rate > 0) {
+        report.eta = (progress->total - offset) / report.rate;
+    }
+
+    progress->last_ns = now;
+    progress->last_offset = offset;
+
+    progress->fn(&report, progress->user_data);
+}
@@ -0,0 +1,211 @@
+#include "mtk_replay.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <libusb.h>
+
+#include "mtk_capture.h"
+#include "mtk_stats.h"
+#include "util.h"
+
+#define SETUP_PACKET_SIZE (8)
+
+static int replay_bulk_transfer(void *ctx, uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout);
+static int replay_control_transfer(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout);
+
+const mtk_transport mtk_replay_transport = {
+    .bulk_transfer = replay_bulk_transfer,
+    .control_transfer = replay_control_transfer,
+};
+
+int mtk_replay_init(mtk_replay *replay, int fd, bool original_timing) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        return -errno;
+    }
+    if ((size_t) st.st_size < sizeof(mtk_capture_header)) {
+        return -EINVAL;
+    }
+
+    const uint8_t *data;
+    if ((data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0)) == MAP_FAILED) {
+        return -errno;
+    }
+
+    mtk_capture_header header;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, MTK_CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != MTK_CAPTURE_VERSION) {
+        munmap((void *) data, st.st_size);
+        return -EINVAL;
+    }
+
+    replay->data = data;
+    replay->size = st.st_size;
+    replay->offset = sizeof(header);
+    replay->original_timing = original_timing;
+    replay->records = 0;
+    replay->diverged = false;
+
+    return 0;
+}
+
+void mtk_replay_finish(mtk_replay *replay) {
+    munmap((void *) replay->data, replay->size);
+}
+
+static int next_record(mtk_replay *replay, uint8_t type, mtk_capture_record *record, const uint8_t **payload) {
+    if (replay->size - replay->offset < sizeof(*record)) {
+        /* Capture ended, as if the device had gone away */
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    memcpy(record, replay->data + replay->offset, sizeof(*record));
+
+    size_t payload_length;
+    if (record->flags & MTK_CAPTURE_FLAG_HASHED) {
+        payload_length = sizeof(uint64_t);
+    } else {
+        payload_length = record->length + (record->type == MTK_CAPTURE_CONTROL ? SETUP_PACKET_SIZE : 0);
+    }
+
+    if (replay->size - replay->offset - sizeof(*record) < payload_length) {
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (record->type != type) {
+        replay->diverged = true;
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    *payload = replay->data + replay->offset + sizeof(*record);
+    replay->offset += sizeof(*record) + payload_length;
+    replay->records++;
+
+    return 0;
+}
+
+static bool payload_matches(const mtk_capture_record *record, const uint8_t *payload, const uint8_t *setup, const uint8_t *data, size_t length) {
+    if (length != record->length) {
+        return false;
+    }
+
+    if (record->flags & MTK_CAPTURE_FLAG_HASHED) {
+        uint64_t hash = MTK_FNV1A64_INIT;
+        if (setup != NULL) {
+            hash = mtk_fnv1a64(hash, setup, SETUP_PACKET_SIZE);
+        }
+        hash = mtk_fnv1a64(hash, data, length);
+
+        return memcmp(&hash, payload, sizeof(hash)) == 0;
+    }
+
+    if (setup != NULL) {
+        if (memcmp(setup, payload, SETUP_PACKET_SIZE) != 0) {
+            return false;
+        }
+        payload += SETUP_PACKET_SIZE;
+    }
+
+    return length == 0 || memcmp(data, payload, length) == 0;
+}
+
+static void wait_duration(const mtk_replay *replay, const mtk_capture_record *record, uint64_t start_ns) {
+    if (!replay->original_timing) {
+        return;
+    }
+
+    uint64_t end_ns = start_ns + record->duration_ns;
+    struct timespec ts = {
+        .tv_sec = end_ns / 1000000000,
+        .tv_nsec = end_ns % 1000000000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int replay_bulk_transfer(void *ctx, uint8_t endpoint, uint8_t *data, int length, int *transferred, unsigned int timeout) {
+    (void) timeout;
+
+    mtk_replay *replay = ctx;
+    uint64_t start_ns = mtk_stats_now();
+    bool in = (endpoint & LIBUSB_ENDPOINT_IN);
+
+    int err;
+    mtk_capture_record record;
+    const uint8_t *payload;
+    if ((err = next_record(replay, in ? MTK_CAPTURE_BULK_IN : MTK_CAPTURE_BULK_OUT, &record, &payload)) < 0) {
+        *transferred = 0;
+        return err;
+    }
+
+    if (in) {
+        if (record.flags & MTK_CAPTURE_FLAG_HASHED) {
+            /* Only the hash of the data the device sent is known */
+            *transferred = 0;
+            return LIBUSB_ERROR_NOT_SUPPORTED;
+        }
+        if (record.length > (uint32_t) length) {
+            replay->diverged = true;
+            *transferred = 0;
+            return LIBUSB_ERROR_OVERFLOW;
+        }
+
+        memcpy(data, payload, record.length);
+    } else {
+        /* The capture may have sent less on error, only compare what was transferred */
+        if ((uint32_t) length != record.requested || !payload_matches(&record, payload, NULL, data, record.length)) {
+            replay->diverged = true;
+            *transferred = 0;
+            return LIBUSB_ERROR_OTHER;
+        }
+    }
+
+    wait_duration(replay, &record, start_ns);
+
+    *transferred = record.length;
+    return record.status;
+}
+
+static int replay_control_transfer(void *ctx, uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout) {
+    (void) timeout;
+
+    mtk_replay *replay = ctx;
+    uint64_t start_ns = mtk_stats_now();
+
+    int err;
+    mtk_capture_record record;
+    const uint8_t *payload;
+    if ((err = next_record(replay, MTK_CAPTURE_CONTROL, &record, &payload)) < 0) {
+        return err;
+    }
+
+    const uint8_t setup[SETUP_PACKET_SIZE] = {
+        request_type, request,
+        value & 0xff, value >> 8,
+        index & 0xff, index >> 8,
+        length & 0xff, length >> 8,
+    };
+
+    if (request_type & LIBUSB_ENDPOINT_IN) {
+        if (record.flags & MTK_CAPTURE_FLAG_HASHED) {
+            return LIBUSB_ERROR_NOT_SUPPORTED;
+        }
+        if (memcmp(setup, payload, SETUP_PACKET_SIZE) != 0 || record.length > length) {
+            replay->diverged = true;
+            return LIBUSB_ERROR_OTHER;
+        }
+
+        memcpy(data, payload + SETUP_PACKET_SIZE, record.length);
+    } else if (!payload_matches(&record, payload, setup, data, record.length)) {
+        replay->diverged = true;
+        return LIBUSB_ERROR_OTHER;
+    }
+
+    wait_duration(replay, &record, start_ns);
+
+    return record.status;
+}
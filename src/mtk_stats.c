@@ -0,0 +1,153 @@
+#include "mtk_stats.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+static const char *timer_names[MTK_STATS_TIMERS] = {
+    [MTK_STATS_PRELOADER_START]          = "preloader_start",
+    [MTK_STATS_PRELOADER_GET_TGT_CONFIG] = "preloader_get_tgt_config",
+    [MTK_STATS_PRELOADER_GET_HW_CODE]    = "preloader_get_hw_code",
+    [MTK_STATS_PRELOADER_GET_HW_SW_VER]  = "preloader_get_hw_sw_ver",
+    [MTK_STATS_PRELOADER_WRITE32]        = "preloader_write32",
+    [MTK_STATS_PRELOADER_SEND_DA]        = "preloader_send_da",
+    [MTK_STATS_PRELOADER_JUMP_DA]        = "preloader_jump_da",
+
+    [MTK_STATS_DA_SYNC]                  = "da_sync",
+    [MTK_STATS_DA_SEND_DA]               = "da_send_da",
+    [MTK_STATS_DA_READ_REPORT]           = "da_read_report",
+    [MTK_STATS_DA_USB_CHECK_STATUS]      = "da_usb_check_status",
+    [MTK_STATS_DA_USB_SETUP_PORT]        = "da_usb_setup_port",
+    [MTK_STATS_DA_PROBE]                 = "da_probe",
+    [MTK_STATS_DA_SWITCH_PART]           = "da_switch_part",
+    [MTK_STATS_DA_READ]                  = "da_read",
+    [MTK_STATS_DA_SDMMC_WRITE_DATA]      = "da_sdmmc_write_data",
+    [MTK_STATS_DA_FORMAT]                = "da_format",
+    [MTK_STATS_DA_ENABLE_WATCHDOG]       = "da_enable_watchdog",
+
+    [MTK_STATS_DA_READ_CHUNK]            = "da_read_chunk",
+    [MTK_STATS_DA_WRITE_CHUNK]           = "da_write_chunk",
+    [MTK_STATS_CHECKSUM]                 = "checksum",
+    [MTK_STATS_HANDLER]                  = "handler",
+
+    [MTK_STATS_USB_BULK_IN]              = "usb_bulk_in",
+    [MTK_STATS_USB_BULK_OUT]             = "usb_bulk_out",
+    [MTK_STATS_USB_CONTROL]              = "usb_control",
+};
+
+static uint64_t timespec_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t mtk_stats_now(void) {
+    return timespec_ns(CLOCK_MONOTONIC);
+}
+
+void mtk_stats_init(mtk_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->start_ns = mtk_stats_now();
+}
+
+void mtk_stats_record(mtk_stats *stats, unsigned int timer, uint64_t elapsed_ns) {
+    mtk_stats_timer *t = &stats->timers[timer];
+
+    if (t->count == 0 || elapsed_ns < t->min_ns) {
+        t->min_ns = elapsed_ns;
+    }
+    if (elapsed_ns > t->max_ns) {
+        t->max_ns = elapsed_ns;
+    }
+    t->count++;
+    t->total_ns += elapsed_ns;
+
+    uint64_t us = elapsed_ns / 1000;
+    size_t bucket = (us > 1) ? (63 - __builtin_clzll(us)) : 0;
+    if (bucket >= MTK_STATS_BUCKETS) {
+        bucket = MTK_STATS_BUCKETS - 1;
+    }
+    t->buckets[bucket]++;
+}
+
+void mtk_stats_phase_begin(mtk_stats *stats, const char *name) {
+    if (stats == NULL) {
+        return;
+    }
+
+    mtk_stats_phase_end(stats);
+
+    if (stats->phases_count == MTK_STATS_MAX_PHASES) {
+        return;
+    }
+
+    mtk_stats_phase *phase = &stats->phases[stats->phases_count++];
+    phase->name = name;
+    phase->start_ns = mtk_stats_now();
+    phase->duration_ns = 0;
+    phase->cpu_ns = 0;
+    phase->bytes_in = stats->bytes_in;
+    phase->bytes_out = stats->bytes_out;
+
+    stats->phase_active = true;
+    stats->phase_cpu_ns = timespec_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void mtk_stats_phase_end(mtk_stats *stats) {
+    if (stats == NULL || !stats->phase_active) {
+        return;
+    }
+
+    mtk_stats_phase *phase = &stats->phases[stats->phases_count - 1];
+    stats->phase_active = false;
+
+    phase->duration_ns = mtk_stats_now() - phase->start_ns;
+    phase->cpu_ns = timespec_ns(CLOCK_PROCESS_CPUTIME_ID) - stats->phase_cpu_ns;
+    phase->bytes_in = stats->bytes_in - phase->bytes_in;
+    phase->bytes_out = stats->bytes_out - phase->bytes_out;
+}
+
+int mtk_stats_write_json(const mtk_stats *stats, FILE *fp) {
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"elapsed_ns\": %" PRIu64 ",\n", mtk_stats_now() - stats->start_ns);
+    fprintf(fp, "  \"bytes_in\": %" PRIu64 ",\n", stats->bytes_in);
+    fprintf(fp, "  \"bytes_out\": %" PRIu64 ",\n", stats->bytes_out);
+    fprintf(fp, "  \"retries\": %" PRIu64 ",\n", stats->retries);
+
+    fprintf(fp, "  \"timers\": {");
+    bool first = true;
+    for (size_t i = 0; i < MTK_STATS_TIMERS; i++) {
+        const mtk_stats_timer *t = &stats->timers[i];
+        if (t->count == 0) {
+            continue;
+        }
+
+        /* Trailing empty buckets are omitted */
+        size_t buckets = MTK_STATS_BUCKETS;
+        while (buckets > 0 && t->buckets[buckets - 1] == 0) {
+            buckets--;
+        }
+
+        fprintf(fp, "%s\n    \"%s\": { \"count\": %" PRIu64 ", \"total_ns\": %" PRIu64 ", \"min_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", \"histogram_log2_us\": [",
+                first ? "" : ",", timer_names[i], t->count, t->total_ns, t->min_ns, t->max_ns);
+        for (size_t j = 0; j < buckets; j++) {
+            fprintf(fp, "%s%" PRIu64, j == 0 ? "" : ", ", t->buckets[j]);
+        }
+        fprintf(fp, "] }");
+        first = false;
+    }
+    fprintf(fp, "\n  },\n");
+
+    fprintf(fp, "  \"phases\": [");
+    for (size_t i = 0; i < stats->phases_count; i++) {
+        const mtk_stats_phase *phase = &stats->phases[i];
+        fprintf(fp, "%s\n    { \"name\": \"%s\", \"start_ns\": %" PRIu64 ", \"duration_ns\": %" PRIu64 ", \"cpu_ns\": %" PRIu64 ", \"bytes_in\": %" PRIu64 ", \"bytes_out\": %" PRIu64 " }",
+                i == 0 ? "" : ",", phase->name, phase->start_ns - stats->start_ns, phase->duration_ns, phase->cpu_ns, phase->bytes_in, phase->bytes_out);
+    }
+    fprintf(fp, "\n  ]\n");
+    fprintf(fp, "}\n");
+
+    return ferror(fp) ? -EIO : 0;
+}
@@ -0,0 +1,25 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes under the "mtk" provider, for perf and bpftrace. Each probe is a
+ * single nop when built against sys/sdt.h, and is compiled out otherwise.
+ */
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a1) DTRACE_PROBE1(mtk, name, a1)
+#define PROBE2(name, a1, a2) DTRACE_PROBE2(mtk, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) DTRACE_PROBE3(mtk, name, a1, a2, a3)
+
+#else
+
+/* Arguments are not evaluated, but still count as used */
+#define PROBE1(name, a1) do { (void) sizeof(a1); } while (0)
+#define PROBE2(name, a1, a2) do { (void) sizeof(a1); (void) sizeof(a2); } while (0)
+#define PROBE3(name, a1, a2, a3) do { (void) sizeof(a1); (void) sizeof(a2); (void) sizeof(a3); } while (0)
+
+#endif
+
+#endif /* PROBES_H */
@@ -0,0 +1,66 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mtk_stats.h"
+#include "probes.h"
+
+typedef struct {
+    mtk_stats *stats;
+    unsigned int timer;
+    /* Whole commands fire the command-start and command-end probes with the timer */
+    bool command;
+    /* Return value of the command, for the command-end probe */
+    int result;
+    uint64_t start_ns;
+} stats_scope;
+
+static inline stats_scope stats_scope_begin(mtk_stats *stats, unsigned int timer, bool command) {
+    if (command) {
+        PROBE1(command__start, timer);
+    }
+
+    stats_scope scope = { stats, timer, command, 0, stats != NULL ? mtk_stats_now() : 0 };
+    return scope;
+}
+
+static inline void stats_scope_end(stats_scope *scope) {
+    if (scope->command) {
+        PROBE2(command__end, scope->timer, scope->result);
+    }
+    if (scope->stats != NULL) {
+        mtk_stats_record(scope->stats, scope->timer, mtk_stats_now() - scope->start_ns);
+    }
+}
+
+/* Times the rest of the enclosing block, including early returns */
+#define STATS_SCOPE(device, timer) \
+    __attribute__((cleanup(stats_scope_end))) stats_scope _stats_scope = stats_scope_begin((device)->stats, (timer), true)
+
+/* Records the return value of a command timed by STATS_SCOPE */
+#define STATS_RESULT(value) (_stats_scope.result = (value))
+
+/* Times a single statement */
+#define STATS_TIME(device, timer, ...) \
+    do { \
+        __attribute__((cleanup(stats_scope_end))) stats_scope _stats_time = stats_scope_begin((device)->stats, (timer), false); \
+        __VA_ARGS__; \
+    } while (0)
+
+static inline void stats_add_bytes(mtk_stats *stats, size_t bytes_in, size_t bytes_out) {
+    if (stats != NULL) {
+        stats->bytes_in += bytes_in;
+        stats->bytes_out += bytes_out;
+    }
+}
+
+static inline void stats_add_retry(mtk_stats *stats) {
+    if (stats != NULL) {
+        stats->retries++;
+    }
+}
+
+#endif /* STATS_H */
@@ -4,4 +4,8 @@
 #define MIN(X, Y) \
     __extension__ ({ __typeof__(X) _X = (X); __typeof__(Y) _Y = (Y); _X < _Y ? _X : _Y; })
 
+#ifndef MAP_POPULATE
+#define MAP_POPULATE (0)
+#endif
+
 #endif /* UTIL_H */